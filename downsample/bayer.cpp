@@ -1,5 +1,11 @@
 #include "bayer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
 #include <stdexcept>
 
 using namespace bayer;
@@ -42,6 +48,45 @@ bool map::is_on(int x, int y, float mix_level) const
 	return values[idx]>=threshold;
 }
 
+threshold_tile map::thresholds(int width, int mix_levels/*=255*/) const
+{
+	if (mix_levels>255)
+		throw std::invalid_argument("mix levels don't fit a threshold tile");
+
+	// the lowest quantized mix at which each value turns on, taken from is_on itself so both agree exactly
+	std::vector<std::uint8_t> value_thresholds(size());
+
+	for (int value=0; value<size(); ++value)
+	{
+		int q=0;
+
+		while (q<mix_levels && value<static_cast<int>((1-q*(1.f/mix_levels))*values.size()+.5f))
+			++q;
+
+		value_thresholds[value]=q;
+	}
+
+	threshold_tile tile;
+
+	tile.rows=rows();
+	tile.width=width;
+
+	while ((1 << tile.pitch_shift)<width)
+		++tile.pitch_shift;
+
+	tile.cells.resize(std::size_t(tile.rows) << tile.pitch_shift);
+
+	for (int y=0; y<tile.rows; ++y)
+	{
+		auto *row=&tile.cells[std::size_t(y) << tile.pitch_shift];
+
+		for (int x=0; x<width; ++x)
+			row[x]=value_thresholds[values[x%cols()+y*cols()]];
+	}
+
+	return tile;
+}
+
 map::operator bool() const
 {
 	return values.size()>0;
@@ -160,3 +205,291 @@ map bayer::generate(int rows, int cols)
 
 	return ret;
 }
+
+namespace
+{
+	//! offsets of a window of radius r on a toroidal axis of size n, each offset at most once
+	std::vector<int> window_offsets(int r, int n)
+	{
+		std::vector<int> offsets;
+		int first=(2*r+1>=n) ? -(n-1)/2 : -r;
+		int last=(2*r+1>=n) ? n/2 : r;
+
+		for (int d=first; d<=last; ++d)
+			offsets.push_back(d);
+
+		return offsets;
+	}
+
+	// Energy of every cell of a toroidal binary pattern, kept up to date while cells are
+	// toggled. The gaussian is cut off at 4 sigma, so a toggle only touches a small window,
+	// and every row remembers its tightest cluster and largest void so that finding the
+	// next one only scans the rows the toggle touched.
+	struct void_and_cluster_t
+	{
+		int rows;
+		int cols;
+		std::vector<int> dys;
+		std::vector<int> dxs;
+		std::vector<float> kernel; //!< by window offset
+		std::vector<float> energy;
+		std::vector<char> pattern;
+		std::vector<int> row_cluster; //!< -1 when the row has no set cell
+		std::vector<int> row_void; //!< -1 when the row has no unset cell
+
+		void_and_cluster_t(int rows, int cols, float aspect, float sigma=1.5f)
+			: rows(rows), cols(cols), energy(rows*cols), pattern(rows*cols), row_cluster(rows, -1), row_void(rows)
+		{
+			dys=window_offsets(int(std::ceil(4*sigma/aspect)), rows);
+			dxs=window_offsets(int(std::ceil(4*sigma)), cols);
+
+			for (int dy : dys)
+			{
+				for (int dx : dxs)
+				{
+					float sy=dy*aspect;
+
+					kernel.push_back(std::exp(-(dx*dx+sy*sy)/(2*sigma*sigma)));
+				}
+			}
+
+			for (int y=0; y<rows; ++y)
+				row_void[y]=y*cols;
+		}
+
+		void toggle(int idx)
+		{
+			float sign=pattern[idx] ? -1.f : 1.f;
+			int py=idx/cols;
+			int px=idx%cols;
+			const float *k=kernel.data();
+
+			pattern[idx]=!pattern[idx];
+
+			for (int dy : dys)
+			{
+				int y=(py+dy+rows)%rows;
+				float *e=&energy[y*cols];
+
+				for (int dx : dxs)
+					e[(px+dx+cols)%cols]+=sign*(*k++);
+
+				update_row(y);
+			}
+		}
+
+		void update_row(int y)
+		{
+			int cluster=-1;
+			int hole=-1;
+
+			for (int i=y*cols; i<(y+1)*cols; ++i)
+			{
+				if (pattern[i])
+				{
+					if (cluster<0 || energy[i]>energy[cluster])
+						cluster=i;
+				}
+				else if (hole<0 || energy[i]<energy[hole])
+					hole=i;
+			}
+
+			row_cluster[y]=cluster;
+			row_void[y]=hole;
+		}
+
+		//! the set cell with the highest energy, the first one of equals
+		int tightest_cluster() const
+		{
+			int best=-1;
+
+			for (int idx : row_cluster)
+			{
+				if (idx>=0 && (best<0 || energy[idx]>energy[best]))
+					best=idx;
+			}
+
+			return best;
+		}
+
+		//! the unset cell with the lowest energy, the first one of equals
+		int largest_void() const
+		{
+			int best=-1;
+
+			for (int idx : row_void)
+			{
+				if (idx>=0 && (best<0 || energy[idx]<energy[best]))
+					best=idx;
+			}
+
+			return best;
+		}
+	};
+}
+
+map bayer::generate_blue_noise(int rows, int cols, float aspect/*=1*/)
+{
+	const int size=rows*cols;
+
+	if (size<=0 || aspect<=0)
+		throw std::invalid_argument("Unsupported row/col count");
+
+	void_and_cluster_t vac(rows, cols, aspect);
+	std::mt19937 gen(size);
+
+	// initial pattern of about a tenth of the cells, relaxed until moving the tightest cluster
+	// into the largest void doesn't change anything
+	for (int placed=0; placed<std::max(1, size/10); )
+	{
+		int idx=gen()%size;
+
+		if (!vac.pattern[idx])
+		{
+			vac.toggle(idx);
+			++placed;
+		}
+	}
+
+	for (;;)
+	{
+		int cluster=vac.tightest_cluster();
+
+		vac.toggle(cluster);
+
+		int hole=vac.largest_void();
+
+		if (hole==cluster)
+		{
+			vac.toggle(cluster);
+			break;
+		}
+
+		vac.toggle(hole);
+	}
+
+	map ret(rows, cols);
+	auto initial=vac;
+	int ones=std::count(vac.pattern.begin(), vac.pattern.end(), 1);
+
+	// ranks below the initial pattern by removing clusters, above it by filling voids; as every
+	// cell sees the same kernel, the tightest cluster of unset cells is the largest void of set ones
+	for (int rank=ones-1; rank>=0; --rank)
+	{
+		int idx=vac.tightest_cluster();
+
+		vac.toggle(idx);
+		ret.values[idx]=rank;
+	}
+
+	vac=std::move(initial);
+
+	for (int rank=ones; rank<size; ++rank)
+	{
+		int idx=vac.largest_void();
+
+		vac.toggle(idx);
+		ret.values[idx]=rank;
+	}
+
+	return ret;
+}
+
+namespace
+{
+	const char blue_noise_magic[8]={ 'B', 'L', 'U', 'E', 'N', 'O', 'I', 'S' };
+	const std::int32_t blue_noise_version=1; //!< bump whenever generate_blue_noise changes its output
+
+	struct blue_noise_file_header
+	{
+		char magic[8];
+		std::int32_t version;
+		std::int32_t rows;
+		std::int32_t cols;
+		float aspect;
+	};
+
+	bool load_blue_noise(const std::string &path, const blue_noise_file_header &expected, map &out)
+	{
+		auto *f=std::fopen(path.c_str(), "rb");
+
+		if (!f)
+			return false;
+
+		blue_noise_file_header header;
+		map loaded(expected.rows, expected.cols);
+		bool ok=std::fread(&header, sizeof(header), 1, f)==1 && std::memcmp(&header, &expected, sizeof(header))==0 &&
+			std::fread(loaded.values.data(), sizeof(int), loaded.size(), f)==std::size_t(loaded.size());
+
+		std::fclose(f);
+
+		// a ranking holds every rank once
+		std::vector<char> seen(loaded.size());
+
+		for (int i=0; ok && i<loaded.size(); ++i)
+		{
+			int v=loaded.values[i];
+
+			ok=v>=0 && v<loaded.size() && !seen[v];
+
+			if (ok)
+				seen[v]=1;
+		}
+
+		if (ok)
+			out=std::move(loaded);
+
+		return ok;
+	}
+
+	void save_blue_noise(const std::string &path, const blue_noise_file_header &header, const map &m)
+	{
+		// written next to the final name and renamed, so other processes never read a partial file
+		auto temp_path=path+".tmp"+std::to_string(std::random_device()());
+		auto *f=std::fopen(temp_path.c_str(), "wb");
+
+		if (!f)
+		{
+			std::perror("Failed to create blue noise cache");
+
+			return;
+		}
+
+		bool ok=std::fwrite(&header, sizeof(header), 1, f)==1 &&
+			std::fwrite(m.values.data(), sizeof(int), m.size(), f)==std::size_t(m.size());
+
+		ok=(std::fclose(f)==0) && ok;
+
+		if (!ok || std::rename(temp_path.c_str(), path.c_str()))
+		{
+			std::perror("Failed to write blue noise cache");
+			std::remove(temp_path.c_str());
+		}
+	}
+}
+
+map bayer::cached_blue_noise(int rows, int cols, float aspect, const std::string &cache_dir)
+{
+	blue_noise_file_header header;
+
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, blue_noise_magic, sizeof(header.magic));
+	header.version=blue_noise_version;
+	header.rows=rows;
+	header.cols=cols;
+	header.aspect=aspect;
+
+	std::ostringstream path;
+
+	path << cache_dir << "/blue_noise_" << rows << "x" << cols << "_" << int(aspect*1000+.5f) << ".bin";
+
+	map ret;
+
+	if (load_blue_noise(path.str(), header, ret))
+		return ret;
+
+	ret=generate_blue_noise(rows, cols, aspect);
+	save_blue_noise(path.str(), header, ret);
+
+	return ret;
+}
@@ -1,10 +1,28 @@
 #ifndef bayer_h__
 #define bayer_h__
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 namespace bayer
 {
+	//! Thresholds of a map repeated along rows of width cells, for mix levels quantized to
+	//! 0..mix_levels: is_on(x, y, q*(1.f/mix_levels)) is q>=row(y)[x]. The pitch of the rows
+	//! is padded to a power of two.
+	struct threshold_tile
+	{
+		std::vector<std::uint8_t> cells;
+		int rows=0;
+		int width=0;
+		int pitch_shift=0;
+
+		const std::uint8_t *row(int y) const
+		{
+			return cells.data()+((y%rows) << pitch_shift);
+		}
+	};
+
 	struct map
 	{
 		/*const */std::vector<int> values;
@@ -27,6 +45,9 @@ namespace bayer
 
 		bool is_on(int x, int y, float mix_level) const;
 
+		//! mix_levels up to 255
+		threshold_tile thresholds(int width, int mix_levels=255) const;
+
 		operator bool() const;
 
 		bool operator!() const;
@@ -35,6 +56,11 @@ namespace bayer
 	extern map get_predefined(int rows, int cols);
 	extern map get_largest_predefined_map(int rows, int cols);
 	extern map generate(int rows, int cols);
+	//! Void-and-cluster ranking of a toroidal tile, the thresholds of which form blue noise.
+	//! aspect is the height of a pixel over its width, so that the noise is even on screen.
+	extern map generate_blue_noise(int rows, int cols, float aspect=1);
+	//! generate_blue_noise, kept in a file in cache_dir between runs
+	extern map cached_blue_noise(int rows, int cols, float aspect, const std::string &cache_dir);
 }
 
 #endif // bayer_h__
@@ -0,0 +1,238 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+
+#include "netvid/framebuffer.h"
+
+#include "cga_downsample.h"
+#include "static_pipeline.h"
+
+// Prints the per pixel cost of the nearest color search for the 16 color palette and the
+// 136 color palette used in the temporal modes, with and without nearest_lut_t, and the cost
+// of the separate linear passes with float and fixed point intermediates, of error diffusion,
+// of the final passes behind linearize against a static pipeline fusing both and of writing
+// packed output pixel by pixel and a row at a time. Fixed point trades conversions in every
+// pass for half the intermediate memory, so expect it to be slower where that memory fits
+// the caches.
+
+template<class func_t>
+static double ns_per_pixel(int pixels, func_t &&func)
+{
+	const int repeats=20;
+
+	func();
+
+	auto start=std::chrono::steady_clock::now();
+
+	for (int i=0; i<repeats; ++i)
+		func();
+
+	std::chrono::duration<double, std::nano> elapsed=std::chrono::steady_clock::now()-start;
+
+	return elapsed.count()/(double(pixels)*repeats);
+}
+
+int main(int argc, char *argv[])
+{
+	const int pixels=640*200;
+	std::mt19937 gen(1);
+	std::uniform_real_distribution<float> dist(0, 1);
+	std::vector<std::array<float, 3>> colors(pixels);
+	std::vector<std::uint8_t> out(pixels);
+
+	for (auto &c : colors)
+		c={ { dist(gen), dist(gen), dist(gen) } };
+
+	auto linear_palette=cga_palette();
+	parallel_process pp;
+
+	for (int combined=0; combined<2; ++combined)
+	{
+		if (combined)
+			std::tie(linear_palette, std::ignore)=combine_palette(linear_palette);
+
+		nearest_palette search(linear_palette);
+
+		auto scalar=ns_per_pixel(pixels, [&] ()
+		{
+			for (int i=0; i<pixels; ++i)
+				out[i]=eval_nearest_color(linear_palette, colors[i]);
+		});
+		auto single=ns_per_pixel(pixels, [&] ()
+		{
+			for (int i=0; i<pixels; ++i)
+				out[i]=search(colors[i]);
+		});
+		auto batched=ns_per_pixel(pixels, [&] ()
+		{
+			search(colors.data(), pixels, out.data());
+		});
+
+		std::cout << linear_palette.size() << " colors: eval_nearest_color " << scalar << " ns/pixel, nearest_palette " << single << " ns/pixel, batched " << batched << " ns/pixel" << std::endl;
+
+		dither_lut_t dither_lut(pp, linear_palette, dither_pair_index(linear_palette, [&] (int left, int right)
+		{
+			return distance(linear_palette[left], linear_palette[right])<.25f;
+		}));
+		auto bayer_map=bayer::generate(8, 8);
+
+		auto dither=ns_per_pixel(pixels, [&] ()
+		{
+			for (int i=0; i<pixels; ++i)
+				out[i]=dither_lut.get(colors[i]).get_dithered(bayer_map, i%640, i/640);
+		});
+
+		auto thresholds=bayer_map.thresholds(640, packed_dithered_color::mix_levels);
+		std::vector<packed_dithered_color> entries(640);
+
+		auto tile=ns_per_pixel(pixels, [&] ()
+		{
+			for (int y=0; y<pixels/640; ++y)
+			{
+				for (int x=0; x<640; ++x)
+					entries[x]=dither_lut.entry(colors[y*640+x]);
+
+				dither_row(entries.data(), thresholds.row(y), 640, out.data()+y*640);
+			}
+		});
+
+		std::cout << linear_palette.size() << " colors: dither_lut_t with bayer " << dither << " ns/pixel, with threshold tile " << tile << " ns/pixel" << std::endl;
+
+		for (const char *precision : { "565", "666", "888" })
+		{
+			nearest_lut_t lut(pp, linear_palette, parse_lut_precision(precision));
+
+			auto lookup=ns_per_pixel(pixels, [&] ()
+			{
+				for (int i=0; i<pixels; ++i)
+					out[i]=lut.get(colors[i]);
+			});
+
+			std::cout << linear_palette.size() << " colors: nearest_lut_t " << precision << " " << lookup << " ns/pixel" << std::endl;
+		}
+	}
+
+	pooled_frame in;
+
+	in.resize(640, 200, 16);
+	in.aspect_ratio=4/3.f;
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; ++x)
+			*in.pixel<std::uint16_t>(x, y)=std::uint16_t(gen());
+	}
+
+	for (auto format : { linear_format::float32, linear_format::fixed16 })
+	{
+		parallel_process p;
+		pooled_frame frame_out;
+
+		p.render_passes.emplace_back(linearize(format));
+		p.render_passes.emplace_back(black_crush(0, 0.015f, format));
+		add_local_contrast(p.render_passes, 4, 0.5f, 0, 0, 1, format);
+		p.render_passes.emplace_back(nearest<>::create(cga_palette()));
+
+		auto frame=ns_per_pixel(pixels, [&] ()
+		{
+			p(in, frame_out);
+		});
+
+		std::size_t intermediate=p.buffer_bytes();
+
+		for (const auto &render_pass : p.render_passes)
+			intermediate+=std::size_t(render_pass.frame.pitch)*render_pass.frame.height;
+
+		std::cout << ((format==linear_format::fixed16) ? "fixed16" : "float32") << " linear passes: " << frame*pixels/1e6 << " ms/frame, " << intermediate/1024 << " KiB of intermediates" << std::endl;
+	}
+
+	for (bool serpentine : { false, true })
+	{
+		parallel_process p;
+		pooled_frame frame_out;
+
+		p.render_passes.emplace_back(linearize());
+		p.render_passes.emplace_back(error_diffusion<>::create(cga_palette(), normal_output(), nearest_lut_t(), serpentine));
+
+		auto frame=ns_per_pixel(pixels, [&] ()
+		{
+			p(in, frame_out);
+		});
+
+		std::cout << (serpentine ? "serpentine" : "raster") << " error diffusion: " << frame*pixels/1e6 << " ms/frame on " << p.num_threads() << " threads" << std::endl;
+	}
+
+	{
+		auto linear_palette=cga_palette();
+		dither_lut_t dither_lut(pp, linear_palette, dither_pair_index(linear_palette, [&] (int left, int right)
+		{
+			return distance(linear_palette[left], linear_palette[right])<.25f;
+		}));
+		auto bayer_map=bayer::generate(8, 8);
+
+		auto frame_ms=[&] (std::vector<parallel_process::render_pass_t> render_passes)
+		{
+			parallel_process p;
+			pooled_frame frame_out;
+
+			p.render_passes=std::move(render_passes);
+
+			return ns_per_pixel(pixels, [&] ()
+			{
+				p(in, frame_out);
+			})*pixels/1e6;
+		};
+		auto print=[&] (const char *name, parallel_process::render_pass_t final_pass, parallel_process::render_pass_t fused)
+		{
+			std::vector<parallel_process::render_pass_t> separate;
+
+			separate.emplace_back(linearize());
+			separate.emplace_back(std::move(final_pass));
+
+			auto separate_ms=frame_ms(std::move(separate));
+			auto fused_ms=frame_ms({ std::move(fused) });
+
+			std::cout << name << ": after linearize " << separate_ms << " ms/frame, static pipeline from sRGB " << fused_ms << " ms/frame" << std::endl;
+		};
+
+		print("nearest", nearest<>::create(linear_palette), make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::nearest(linear_palette), stage::output<normal_output>()));
+		print("bayer_r", bayer_r<>::create(bayer_map, dither_lut), make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::bayer_r(bayer_map, dither_lut), stage::output<normal_output>()));
+		print("temporal_error_diffusion", temporal_error_diffusion<>::create(linear_palette), make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::temporal_error_diffusion(linear_palette), stage::output<normal_output>()));
+	}
+
+	{
+		pooled_frame frame_out;
+		temporal_dither_output tdo;
+
+		std::tie(std::ignore, tdo.indices)=combine_palette(cga_palette());
+
+		for (auto &c : out)
+			c=std::uint8_t(gen()%16);
+
+		auto writes=[&] (auto output_algorithm, const char *name)
+		{
+			output_algorithm.new_frame(in, frame_out);
+
+			auto per_pixel=ns_per_pixel(pixels, [&] ()
+			{
+				for (int y=0; y<in.height; ++y)
+				{
+					for (int x=0; x<in.width; ++x)
+						output_algorithm.pp(frame_out, x, y, out[y*in.width+x]);
+				}
+			});
+			auto rows=ns_per_pixel(pixels, [&] ()
+			{
+				for (int y=0; y<in.height; ++y)
+					output_algorithm.write_row(frame_out, 0, y, out.data()+y*in.width, in.width);
+			});
+
+			std::cout << name << ": pp " << per_pixel << " ns/pixel, write_row " << rows << " ns/pixel" << std::endl;
+		};
+
+		writes(normal_output(), "normal_output");
+		writes(tdo, "temporal_dither_output");
+	}
+
+	return 0;
+}
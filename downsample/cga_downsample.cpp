@@ -1,8 +1,20 @@
 #include "cga_downsample.h"
 
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <sstream>
 #include <thread>
 
 #include "hsp.h"
+#include "static_pipeline.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 std::uint8_t eval_nearest_color(const std::vector<std::array<float, 3>> &linear_palette, const std::array<float, 3> &linear_color, float *best_distance_out/*=nullptr*/)
 {
@@ -47,6 +59,16 @@ float eval_dither_mix(const std::array<float, 3> &target_color, const std::array
 	return eval_dither_mix(Vector3f(target_color.data()), Vector3f(left_color.data()), Vector3f(right_color.data()));
 }
 
+// shared by both searches so that they round alike
+static float eval_dither_distance(const Eigen::Vector3f &target, const Eigen::Vector3f &left, const Eigen::Vector3f &right, float &mix_level)
+{
+	mix_level=eval_dither_mix(target, left, right);
+
+	Eigen::Vector3f mix_point=left+(right-left)*mix_level;
+
+	return (target-mix_point).norm();
+}
+
 dithered_color eval_nearest_dithered_color(const std::vector<std::array<float, 3>> &linear_palette, const std::function<bool(int, int)> &allowed_dither, const std::array<float, 3> &linear_color, float *best_distance_out)
 {
 	using Eigen::Vector3f;
@@ -81,9 +103,8 @@ dithered_color eval_nearest_dithered_color(const std::vector<std::array<float, 3
 
 			const auto &right_color=linear_palette[j];
 			Vector3f right(right_color.data());
-			auto mix_level=eval_dither_mix(target, left, right);
-			auto mix_point=left+(right-left)*mix_level;
-			auto distance=(target-mix_point).norm();
+			float mix_level=0;
+			auto distance=eval_dither_distance(target, left, right, mix_level);
 
 			if (distance>=best_distance)
 				continue;
@@ -99,53 +120,546 @@ dithered_color eval_nearest_dithered_color(const std::vector<std::array<float, 3
 	return best;
 }
 
+dither_pair_index::dither_pair_index(const std::vector<std::array<float, 3>> &linear_palette, const std::function<bool(int, int)> &allowed_dither)
+	: linear_palette(linear_palette)
+{
+	for (std::size_t i=0; i<linear_palette.size(); ++i)
+	{
+		for (std::size_t j=i+1; j<linear_palette.size(); ++j)
+		{
+			if (!allowed_dither(i, j))
+				continue;
+
+			pair_t pair;
+
+			pair.left=std::uint8_t(i);
+			pair.right=std::uint8_t(j);
+			pair.order=int(pairs.size());
+			pairs.push_back(pair);
+		}
+	}
+
+	if (!pairs.empty())
+		build(0, int(pairs.size()));
+}
+
+int dither_pair_index::build(int begin, int end)
+{
+	node_t node;
+
+	node.min.fill(std::numeric_limits<float>::max());
+	node.max.fill(-std::numeric_limits<float>::max());
+
+	for (int p=begin; p<end; ++p)
+	{
+		for (int c=0; c<3; ++c)
+		{
+			for (auto idx : { pairs[p].left, pairs[p].right })
+			{
+				node.min[c]=std::min(node.min[c], linear_palette[idx][c]);
+				node.max[c]=std::max(node.max[c], linear_palette[idx][c]);
+			}
+		}
+	}
+
+	int node_idx=int(nodes.size());
+
+	nodes.push_back(node);
+
+	if (end-begin<=leaf_size)
+	{
+		nodes[node_idx].begin=begin;
+		nodes[node_idx].end=end;
+
+		return node_idx;
+	}
+
+	// median split of the segment centers along the longest axis
+	int axis=0;
+
+	for (int c=1; c<3; ++c)
+	{
+		if (node.max[c]-node.min[c]>node.max[axis]-node.min[axis])
+			axis=c;
+	}
+
+	int middle=begin+(end-begin)/2;
+
+	std::nth_element(pairs.begin()+begin, pairs.begin()+middle, pairs.begin()+end, [&] (const pair_t &a, const pair_t &b)
+	{
+		return linear_palette[a.left][axis]+linear_palette[a.right][axis]<linear_palette[b.left][axis]+linear_palette[b.right][axis];
+	});
+
+	int left_child=build(begin, middle);
+	int right_child=build(middle, end);
+
+	nodes[node_idx].children[0]=left_child;
+	nodes[node_idx].children[1]=right_child;
+
+	return node_idx;
+}
+
+dithered_color dither_pair_index::operator()(const std::array<float, 3> &linear_color, float *best_distance_out) const
+{
+	using Eigen::Vector3f;
+
+	// exact distances can round below the true distance, so boxes are only skipped when
+	// they're farther than this beyond the best distance
+	const float margin=1e-5f;
+
+	float best_distance=std::numeric_limits<float>::max();
+	int best_order=-1;
+	dithered_color best;
+	Vector3f target(linear_color.data());
+
+	// solid colors come before all pairs, exactly as in eval_nearest_dithered_color
+	for (std::size_t i=0; i<linear_palette.size(); ++i)
+	{
+		Vector3f left(linear_palette[i].data());
+		auto distance=(target-left).norm();
+
+		if (distance>=best_distance)
+			continue;
+
+		best_distance=distance;
+		best={ std::uint8_t(i), std::uint8_t(i), 0 };
+	}
+
+	auto box_distance=[&] (const node_t &node)
+	{
+		float d2=0;
+
+		for (int c=0; c<3; ++c)
+		{
+			float d=std::max(0.f, std::max(node.min[c]-linear_color[c], linear_color[c]-node.max[c]));
+
+			d2+=d*d;
+		}
+
+		return std::sqrt(d2);
+	};
+
+	if (nodes.empty())
+	{
+		if (best_distance_out)
+			*best_distance_out=best_distance;
+
+		return best;
+	}
+
+	// nearer child first, the stack holds nodes with the distance of their box
+	std::array<std::pair<int, float>, 64> stack;
+	int stack_size=0;
+
+	stack[stack_size++]=std::make_pair(0, box_distance(nodes[0]));
+
+	while (stack_size>0)
+	{
+		auto entry=stack[--stack_size];
+
+		if (entry.second>best_distance+margin)
+			continue;
+
+		const auto &node=nodes[entry.first];
+
+		if (node.children[0]<0)
+		{
+			for (int p=node.begin; p<node.end; ++p)
+			{
+				const auto &pair=pairs[p];
+				Vector3f left(linear_palette[pair.left].data());
+				Vector3f right(linear_palette[pair.right].data());
+				float mix_level=0;
+				auto distance=eval_dither_distance(target, left, right, mix_level);
+
+				// the earliest pair in visiting order wins ties, like the linear scan
+				if (distance>best_distance || (distance==best_distance && (best_order<0 || pair.order>best_order)))
+					continue;
+
+				best_distance=distance;
+				best_order=pair.order;
+				best={ pair.left, pair.right, mix_level };
+			}
+
+			continue;
+		}
+
+		auto near=std::make_pair(node.children[0], box_distance(nodes[node.children[0]]));
+		auto far=std::make_pair(node.children[1], box_distance(nodes[node.children[1]]));
+
+		if (far.second<near.second)
+			std::swap(near, far);
+
+		stack[stack_size++]=far;
+		stack[stack_size++]=near;
+	}
+
+	if (best_distance_out)
+		*best_distance_out=best_distance;
+
+	return best;
+}
+
+const std::uint32_t dither_lut_t::cache_version;
+
 dither_lut_t::dither_lut_t()
+	: channels{ { srgb_quantizer(pixel_fmt().r), srgb_quantizer(pixel_fmt().g), srgb_quantizer(pixel_fmt().b) } }
 {
 
 }
 
 dither_lut_t::dither_lut_t(const std::vector<std::array<float, 3>> &linear_palette, const std::function<dithered_color(const std::array<float, 3> &)> &dither_lookup)
-	: linear_palette(linear_palette)
+	: dither_lut_t(*std::unique_ptr<parallel_process>(new parallel_process()), linear_palette, dither_lookup)
 {
-	lookup.resize(1 << pixel_fmt().visible_bits());
 
-	boost::asio::io_service io_service;
-	std::vector<std::thread> threads;
-	int thread_count=std::thread::hardware_concurrency();
+}
+
+dither_lut_t::dither_lut_t(parallel_process &pp, const std::vector<std::array<float, 3>> &linear_palette, const std::function<dithered_color(const std::array<float, 3> &)> &dither_lookup)
+	: dither_lut_t()
+{
+	auto table=std::make_shared<table_storage>(size()*sizeof(packed_dithered_color));
+	auto *entries=reinterpret_cast<packed_dithered_color *>(table->data);
 
-	threads.reserve(thread_count);
+	this->linear_palette=linear_palette;
 
-	for (int i=0; i<thread_count; ++i)
+	pp.run(size(), [&] (const render_context &ctx)
 	{
-		int begin_row=(lookup.size()*i)/thread_count;
-		int end_row=(lookup.size()*(i+1))/thread_count;
+		int begin_row, end_row;
 
-		io_service.post([&, begin_row, end_row]
+		std::tie(begin_row, end_row)=ctx.rows(size());
+
+		for (int r=begin_row; r<end_row; ++r)
 		{
-			for (int r=begin_row; r<end_row; ++r)
-			{
-				auto l=to_linear(to_float_srgb(pixel_fmt(), r));
+			auto l=to_linear(to_float_srgb(pixel_fmt(), r));
 
-				lookup[r]=dither_lookup(l);
-			}
-		});
+			entries[r]=dither_lookup(l);
+		}
+	});
+
+	// colors of the palette itself have to come out solid, not just the centers of their cells
+	for (const auto &color : linear_palette)
+		entries[index(color)]=dither_lookup(color);
+
+	storage=table;
+	lookup=entries;
+}
+
+dither_lut_t::dither_lut_t(parallel_process &pp, const std::vector<std::array<float, 3>> &linear_palette, const std::function<dithered_color(const std::array<float, 3> &)> &dither_lookup, const std::string &cache_dir, const std::string &lookup_id)
+	: dither_lut_t()
+{
+	this->linear_palette=linear_palette;
+
+	auto key=cache_key(lookup_id);
+	auto path=cache_path(cache_dir, lookup_id);
+
+	if (load(path, key))
+		return;
+
+	*this=dither_lut_t(pp, linear_palette, dither_lookup);
+
+	save(path, key);
+}
+
+namespace
+{
+
+// Cache files are the header followed by the entries as laid out in memory. Files written
+// on a machine with a different byte order or entry layout are rejected, not converted.
+struct dither_lut_file_header
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	std::uint64_t key;
+	std::uint32_t entry_size;
+	std::uint32_t entry_count;
+	char padding[32];
+};
+
+const char dither_lut_magic[8]="DITHLUT";
+const std::uint32_t dither_lut_byte_order=0x01020304;
+
+// FNV-1a
+struct hasher
+{
+	std::uint64_t hash=0xcbf29ce484222325ull;
+
+	void add(const void *data, std::size_t size)
+	{
+		const auto *bytes=static_cast<const std::uint8_t *>(data);
+
+		for (std::size_t i=0; i<size; ++i)
+			hash=(hash ^ bytes[i])*0x100000001b3ull;
+	}
+
+	template<class T>
+	void add(const T &value)
+	{
+		add(&value, sizeof(value));
+	}
+};
+
+}
+
+std::uint64_t dither_lut_t::cache_key(const std::string &lookup_id) const
+{
+	hasher h;
+
+	h.add(cache_version);
+
+	for (const auto &color : linear_palette)
+		h.add(color.data(), sizeof(float)*color.size());
+
+	h.add(lookup_id.data(), lookup_id.size());
+
+	for (auto bits : { pixel_fmt().r, pixel_fmt().g, pixel_fmt().b })
+		h.add(std::int32_t(bits));
+
+	h.add(std::uint32_t(sizeof(packed_dithered_color)));
+
+	return h.hash;
+}
+
+std::string dither_lut_t::cache_path(const std::string &cache_dir, const std::string &lookup_id) const
+{
+	std::ostringstream path;
+
+	path << cache_dir << "/dither_lut_" << std::hex << std::setw(16) << std::setfill('0') << cache_key(lookup_id) << ".bin";
+
+	return path.str();
+}
+
+bool dither_lut_t::load(const std::string &path, std::uint64_t key)
+{
+	const std::size_t bytes=sizeof(dither_lut_file_header)+size()*sizeof(packed_dithered_color);
+	auto file=std::make_shared<table_storage>(path);
+
+	if (!file->data || file->size!=bytes)
+		return false;
+
+	dither_lut_file_header header;
+
+	std::memcpy(&header, file->data, sizeof(header));
+
+	if (std::memcmp(header.magic, dither_lut_magic, sizeof(header.magic)) || header.version!=cache_version ||
+		header.byte_order!=dither_lut_byte_order || header.key!=key ||
+		header.entry_size!=sizeof(packed_dithered_color) || header.entry_count!=size())
+		return false;
+
+	storage=file;
+	lookup=reinterpret_cast<const packed_dithered_color *>(file->data+sizeof(header));
+
+	return true;
+}
+
+bool dither_lut_t::save(const std::string &path, std::uint64_t key) const
+{
+	dither_lut_file_header header;
+
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, dither_lut_magic, sizeof(header.magic));
+	header.version=cache_version;
+	header.byte_order=dither_lut_byte_order;
+	header.key=key;
+	header.entry_size=sizeof(packed_dithered_color);
+	header.entry_count=size();
+
+	// written next to the final name and renamed, so other processes never map a partial file
+	auto temp_path=path+".tmp"+std::to_string(std::random_device()());
+	auto *f=std::fopen(temp_path.c_str(), "wb");
+
+	if (!f)
+	{
+		std::perror("Failed to create dither table cache");
+
+		return false;
+	}
+
+	bool ok=std::fwrite(&header, sizeof(header), 1, f)==1 &&
+		std::fwrite(lookup, sizeof(packed_dithered_color), size(), f)==size();
+
+	ok=(std::fclose(f)==0) && ok;
+
+	if (!ok || std::rename(temp_path.c_str(), path.c_str()))
+	{
+		std::perror("Failed to write dither table cache");
+		std::remove(temp_path.c_str());
+
+		return false;
+	}
+
+	return true;
+}
+
+srgb_quantizer::srgb_quantizer(int bits/*=8*/)
+	: bits(bits)
+{
+	int max_level=levels()-1;
+
+	for (int q=0; q<max_level; ++q)
+	{
+		float srgb=(q+.5f)/max_level;
+
+		thresholds.push_back(to_linear(std::array<float, 3>{ srgb, srgb, srgb })[0]);
+	}
+
+	thresholds.push_back(std::numeric_limits<float>::max());
+
+	int q=0;
+
+	for (int bucket=0; bucket<buckets; ++bucket)
+	{
+		while (float(bucket)/buckets>=thresholds[q])
+			++q;
+
+		bucket_levels.push_back(q);
+	}
+}
+
+void dither_row(const packed_dithered_color *entries, const std::uint8_t *thresholds, int count, std::uint8_t *out)
+{
+	static_assert(sizeof(packed_dithered_color)==4, "entries are loaded four bytes at a time");
+
+	int x=0;
+
+#if defined(__SSE2__)
+	const __m128i byte_mask=_mm_set1_epi32(0xff);
+
+	// left, right and mix of 16 entries, each narrowed from 32 bit lanes to bytes
+	auto field=[&] (const __m128i *e, int shift)
+	{
+		__m128i low=_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(e), shift), byte_mask), _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(e+1), shift), byte_mask));
+		__m128i high=_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(e+2), shift), byte_mask), _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(e+3), shift), byte_mask));
+
+		return _mm_packus_epi16(low, high);
+	};
+
+	for (; x+16<=count; x+=16)
+	{
+		const auto *e=reinterpret_cast<const __m128i *>(entries+x);
+		__m128i mix=field(e, 16);
+		__m128i threshold=_mm_loadu_si128(reinterpret_cast<const __m128i *>(thresholds+x));
+		__m128i on=_mm_cmpeq_epi8(_mm_max_epu8(mix, threshold), mix);
+		__m128i color=_mm_or_si128(_mm_and_si128(on, field(e, 8)), _mm_andnot_si128(on, field(e, 0)));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out+x), color);
+	}
+#elif defined(__ARM_NEON)
+	for (; x+16<=count; x+=16)
+	{
+		uint8x16x4_t e=vld4q_u8(reinterpret_cast<const std::uint8_t *>(entries+x));
+		uint8x16_t on=vcgeq_u8(e.val[2], vld1q_u8(thresholds+x));
+
+		vst1q_u8(out+x, vbslq_u8(on, e.val[1], e.val[0]));
+	}
+#endif
+
+	for (; x<count; ++x)
+		out[x]=(entries[x].mix>=thresholds[x]) ? entries[x].right_color : entries[x].left_color;
+}
+
+void pack_nibbles(const std::uint8_t *colors, int count, std::uint8_t *out)
+{
+	int x=0;
+
+#if defined(__SSE2__)
+	const __m128i low_byte=_mm_set1_epi16(0xff);
+
+	// a 16 bit lane holds an even and an odd pixel; shifted down by four the odd one lands in the high nibble
+	auto pairs=[&] (const std::uint8_t *c)
+	{
+		__m128i v=_mm_loadu_si128(reinterpret_cast<const __m128i *>(c));
+
+		return _mm_and_si128(_mm_or_si128(v, _mm_srli_epi16(v, 4)), low_byte);
+	};
+
+	for (; x+32<=count; x+=32)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out+x/2), _mm_packus_epi16(pairs(colors+x), pairs(colors+x+16)));
+#elif defined(__ARM_NEON)
+	for (; x+32<=count; x+=32)
+	{
+		uint8x16x2_t c=vld2q_u8(colors+x);
+
+		vst1q_u8(out+x/2, vorrq_u8(c.val[0], vshlq_n_u8(c.val[1], 4)));
 	}
+#endif
+
+	for (; x<count; x+=2)
+		out[x/2]=colors[x] | (colors[x+1] << 4);
+}
 
-	for (int i=0; i<thread_count; ++i)
-		threads.emplace_back([&] { io_service.run(); });
+lut_precision parse_lut_precision(const std::string &s)
+{
+	if (s=="565")
+		return lut_precision::r5g6b5;
+	else if (s=="666")
+		return lut_precision::r6g6b6;
+	else if (s=="888")
+		return lut_precision::r8g8b8;
+
+	throw std::invalid_argument("invalid lookup table precision");
+}
+
+nearest_lut_t::nearest_lut_t()
+{
 
-	for (auto &t : threads)
-		t.join();
 }
 
-dithered_color dither_lut_t::get(const std::array<float, 3> &linear_color) const
+nearest_lut_t::nearest_lut_t(parallel_process &pp, const std::vector<std::array<float, 3>> &linear_palette, lut_precision precision)
+	: linear_palette(linear_palette)
 {
-	auto c=from_float_srgb(pixel_fmt(), to_srgb(linear_color));
-	auto result=lookup[c];
+	switch (precision)
+	{
+	case lut_precision::r5g6b5:
+		channels={ { srgb_quantizer(5), srgb_quantizer(6), srgb_quantizer(5) } };
+		break;
+	case lut_precision::r6g6b6:
+		channels={ { srgb_quantizer(6), srgb_quantizer(6), srgb_quantizer(6) } };
+		break;
+	case lut_precision::r8g8b8:
+		channels={ { srgb_quantizer(8), srgb_quantizer(8), srgb_quantizer(8) } };
+		break;
+	}
+
+	// one row of the build per red and green level
+	const int blue_levels=channels[2].levels();
+	const int rows=channels[0].levels()*channels[1].levels();
+	auto table=std::make_shared<table_storage>(std::size_t(rows)*blue_levels);
+	nearest_palette search(linear_palette);
 
-	result.mix=eval_dither_mix(linear_color, linear_palette[result.left_color], linear_palette[result.right_color]);
+	pp.run(rows, [&] (const render_context &ctx)
+	{
+		int begin_row, end_row;
+		std::vector<std::array<float, 3>> colors(blue_levels);
+
+		std::tie(begin_row, end_row)=ctx.rows(rows);
+
+		for (int r=begin_row; r<end_row; ++r)
+		{
+			for (int b=0; b<blue_levels; ++b)
+				colors[b]=grid_color(std::uint32_t(r)*blue_levels+b);
 
-	return result;
+			search(colors.data(), blue_levels, table->data+std::size_t(r)*blue_levels);
+		}
+	});
+
+	lookup=table;
+}
+
+std::array<float, 3> nearest_lut_t::grid_color(std::uint32_t index) const
+{
+	std::array<float, 3> srgb;
+	int shift=channels[1].bits+channels[2].bits;
+
+	for (int i=0; i<3; ++i)
+	{
+		int max_level=channels[i].levels()-1;
+
+		srgb[i]=float((index >> shift) & max_level)/max_level;
+		shift-=(i<2) ? channels[i+1].bits : 0;
+	}
+
+	return to_linear(srgb);
 }
 
 float gaussian_kernel(float x, float stddev)
@@ -365,23 +879,6 @@ std::array<float, 3> srgb_from_image(const frame_data &in, int x, int y)
 	return srgb;
 }
 
-// adapted from https://en.wikipedia.org/wiki/Smoothstep
-float clamp(float x, float lowerlimit, float upperlimit)
-{
-    if (x < lowerlimit) x = lowerlimit;
-    if (x > upperlimit) x = upperlimit;
-    return x;
-}
-
-// adapted from https://en.wikipedia.org/wiki/Smoothstep
-float smootherstep(float edge0, float edge1, float x)
-{
-    // Scale, and clamp x to 0..1 range
-    x = clamp((x - edge0)/(edge1 - edge0), 0.0, 1.0);
-    // Evaluate polynomial
-    return x*x*x*(x*(x*6 - 15) + 10);
-}
-
 std::array<float, 3> calc_local_contrast(float avg, float var, const std::array<float, 3> &linear_color, float gain, float black_crush_high=0.015f, float black_crush_low=0)
 {
 	float stddev=sqrt(var);
@@ -431,13 +928,15 @@ std::array<float, 3> local_contrast(const frame_data &img, int x, int y, float s
 	return calc_local_contrast(avg, var, linear_color, gain);
 }
 
-parallel_process::render_pass_t linearize()
+parallel_process::render_pass_t linearize(linear_format format)
 {
+	const int bpp=linear_bpp(format);
+
 	return
 	{
 		[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
 		{
-			render_pass.frame.resize(in.width, in.height, sizeof(float)*3*8);
+			render_pass.frame.resize(in.width, in.height, bpp);
 		},
 		[=] (const frame_data &in, frame_data &out, const render_context &ctx)
 		{
@@ -445,16 +944,18 @@ parallel_process::render_pass_t linearize()
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			for (int y=line_start; y<line_end; ++y)
+			dispatch_linear(out.bpp, [&] (auto pixel)
 			{
-				for (int x=0; x<in.width; ++x)
-				{
-					auto &o=*out.pixel<std::array<float, 3>>(x, y);
+				typedef decltype(pixel) pixel_t;
 
-					o=to_linear(srgb_from_image(in, x, y));
+				for (int y=line_start; y<line_end; ++y)
+				{
+					for (int x=0; x<in.width; ++x)
+						store_linear(*out.pixel<pixel_t>(x, y), to_linear(srgb_from_image(in, x, y)));
 				}
-			}
-		}
+			});
+		},
+		bpp
 	};
 }
 
@@ -473,17 +974,23 @@ parallel_process::render_pass_t unlinearize(const pixel_format<storage_type> &fm
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			for (int y=line_start; y<line_end; ++y)
+			dispatch_linear(in.bpp, [&] (auto pixel)
 			{
-				for (int x=0; x<in.width; ++x)
+				typedef decltype(pixel) pixel_t;
+
+				for (int y=line_start; y<line_end; ++y)
 				{
-					auto &i=*in.pixel<std::array<float, 3>>(x, y);
-					auto &o=*out.pixel<storage_type>(x, y);
+					for (int x=0; x<in.width; ++x)
+					{
+						auto i=load_linear(*in.pixel<pixel_t>(x, y));
+						auto &o=*out.pixel<storage_type>(x, y);
 
-					o=from_float_srgb(fmt, to_srgb(i));
+						o=from_float_srgb(fmt, to_srgb(i));
+					}
 				}
-			}
-		}
+			});
+		},
+		fmt.bits()
 	};
 }
 
@@ -493,121 +1000,222 @@ parallel_process::render_pass_t unlinearize<std::uint32_t>(const pixel_format<st
 template
 parallel_process::render_pass_t unlinearize<std::uint16_t>(const pixel_format<std::uint16_t> &fmt);
 
-void lc_blur(std::vector<parallel_process::render_pass_t> &render_passes, float stddev, const std::shared_ptr<frame_data_managed> &dest=nullptr)
+struct blur_schedule_t
+{
+	int interval=1;
+	int frame=0;
+	int width=0;
+	int height=0;
+	bool skip=false; //!< set by the first pass' init, read by every render
+};
+
+//! like dispatch_linear for the statistics of lc_blur, with the scale that turns their stored values into floats
+template<class func_t>
+static void dispatch_stats(int bpp, func_t &&func)
+{
+	if (bpp==stats_bpp(linear_format::fixed16))
+		func(std::array<std::uint16_t, 2>(), 1/65535.f);
+	else
+		func(std::array<float, 2>(), 1.f);
+}
+
+//! row of floats for the calling thread, which only grows so that steady state rendering doesn't allocate
+static std::array<float, 2> *stats_row(int width)
+{
+	static thread_local std::vector<std::array<float, 2>> row;
+
+	if (int(row.size())<width)
+		row.resize(width);
+
+	return row.data();
+}
+
+//! with interval>1 the statistics are only recomputed every interval frames and dest keeps them in between
+//! stores the statistics in the given format, dest has to be declared with stats_bpp(format)
+void lc_blur(std::vector<parallel_process::render_pass_t> &render_passes, float stddev, const parallel_process::buffer_ptr &dest=nullptr, int interval=1, linear_format format=linear_format::float32)
 {
-	auto blur_pre=std::make_shared<frame_data_managed>();
-	auto blur_x=std::make_shared<frame_data_managed>();
+	const int bpp=stats_bpp(format);
+	auto blur_pre=std::make_shared<parallel_process::buffer_t>("lc_blur_pre", bpp);
+	auto blur_x=std::make_shared<parallel_process::buffer_t>("lc_blur_x", bpp);
 	weighted_sample_1d_t ws;
 	auto ws_horizontal=std::make_shared<weighted_sample_1d_t>();
+	auto schedule=std::make_shared<blur_schedule_t>();
+
+	schedule->interval=std::max(1, interval);
+
+	if (dest)
+		dest->persistent=schedule->interval>1;
 
 	ws.init_kernel(stddev);
 	ws_horizontal->init_kernel(stddev);
 
-	auto sampler_pre=[&] (const frame_data &img, int x, int y) -> std::array<float, 2>
+	auto sampler_pre=[&] (const auto &pixel) -> std::array<float, 2>
 	{
-		auto linear_color=*img.pixel<std::array<float, 3>>(x, y);
-		auto hsp=rgb_to_hsp(linear_color);
+		auto hsp=rgb_to_hsp(load_linear(pixel));
 
 		return  { hsp[2], hsp[2]*hsp[2] };
 	};
 
-	auto sampler=[&] (const frame_data &img, int x, int y) -> std::array<float, 2>
-	{
-		return *img.pixel<std::array<float, 2>>(x, y);
-	};
-
 	render_passes.emplace_back(
 		[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
 		{
-			render_pass.frame.resize(in.width, in.height, in.pitch, in.bpp);
-			render_pass.no_output=true;
-			blur_pre->resize(in.width, in.height, sizeof(float)*2*8);
+			// statistics of another mode can't be reused
+			if (in.width!=schedule->width || in.height!=schedule->height)
+			{
+				schedule->width=in.width;
+				schedule->height=in.height;
+				schedule->frame=0;
+			}
+
+			schedule->skip=(schedule->frame%schedule->interval)!=0;
+			++schedule->frame;
 		},
 		[=] (const frame_data &in, frame_data &out, const render_context &ctx)
 		{
+			if (schedule->skip)
+				return;
+
 			int line_start, line_end;
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			for (int y=line_start; y<line_end; ++y)
+			dispatch_linear(in.bpp, [&] (auto pixel)
 			{
-				for (int x=0; x<in.width; ++x)
+				typedef decltype(pixel) pixel_t;
+
+				dispatch_stats(bpp, [&] (auto stat, float scale)
 				{
-					auto &o=*blur_pre->pixel<std::array<float, 2>>(x, y);
+					typedef decltype(stat) stat_t;
 
-					o=sampler_pre(in, x, y);
-				}
-			}
+					for (int y=line_start; y<line_end; ++y)
+					{
+						for (int x=0; x<in.width; ++x)
+							store_linear(*blur_pre->frame.pixel<stat_t>(x, y), sampler_pre(*in.pixel<pixel_t>(x, y)));
+					}
+				});
+			});
 		});
 
+	render_passes.back().no_output=true;
+	render_passes.back().writes={ blur_pre };
+
 	render_passes.emplace_back(
 		[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
 		{
-			render_pass.frame.resize(in.width, in.height, in.pitch, in.bpp);
-			render_pass.no_output=true;
-			blur_x->resize(in.width, in.height, sizeof(float)*2*8);
 			ws_horizontal->frame_width=in.width;
 			ws_horizontal->frame_height=in.height;
 			ws_horizontal->init_kernel(stddev*in.width/(in.height*in.aspect_ratio));
 		},
 		[=] (const frame_data &in, frame_data &out, const render_context &ctx) mutable
 		{
+			if (schedule->skip)
+				return;
+
 			int line_start, line_end;
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			for (int y=line_start; y<line_end; ++y)
+			auto *row=stats_row(in.width);
+
+			dispatch_stats(bpp, [&] (auto stat, float scale)
 			{
-				for (int x=0; x<in.width; ++x)
+				typedef decltype(stat) stat_t;
+
+				for (int y=line_start; y<line_end; ++y)
 				{
-					auto &o=*blur_x->pixel<std::array<float, 2>>(x, y);
+					const auto *src=blur_pre->frame.pixel<stat_t>(0, y);
+
+					// converted once instead of for every tap
+					for (int x=0; x<in.width; ++x)
+						row[x]={ { float(src[x][0]), float(src[x][1]) } };
 
-					o=ws_horizontal->operator()<std::array<float, 2>>(x, y, true, math_array(), [&] (int x, int y) { return sampler(*blur_pre, x, y); });
+					for (int x=0; x<in.width; ++x)
+					{
+						auto v=ws_horizontal->operator()<std::array<float, 2>>(x, y, true, math_array(), [&] (int x, int y) { return row[x]; });
+
+						store_linear(*blur_x->frame.pixel<stat_t>(x, y), { { v[0]*scale, v[1]*scale } });
+					}
 				}
-			}
+			});
 		});
 
+	render_passes.back().no_output=true;
+	render_passes.back().reads={ blur_pre };
+	render_passes.back().writes={ blur_x };
+
 	render_passes.emplace_back(
 		[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
 		{
-			render_pass.frame.resize(in.width, in.height, in.pitch, sizeof(float)*2*8);
-
-			if (dest)
-			{
-				render_pass.no_output=true;
-				dest->resize(in.width, in.height, sizeof(float)*2*8);
-			}
+			if (!dest)
+				render_pass.frame.resize(in.width, in.height, bpp);
 		},
-		[=] (const frame_data &in, frame_data &out, const render_context &ctx) mutable
+		[=] (const frame_data &in, frame_data &out, const render_context &ctx)
 		{
+			if (schedule->skip)
+				return;
+
 			int line_start, line_end;
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			ws.frame_width=in.width;
-			ws.frame_height=in.height;
+			auto &current_dest=dest ? dest->frame : out;
 
-			auto &current_dest=dest ? *dest : out;
+			auto *sum=stats_row(in.width);
+			const int half=ws.kernel.size()/2;
 
-			for (int y=line_start; y<line_end; ++y)
+			dispatch_stats(bpp, [&] (auto stat, float scale)
 			{
-				for (int x=0; x<in.width; ++x)
+				typedef decltype(stat) stat_t;
+
+				for (int y=line_start; y<line_end; ++y)
 				{
-					auto &o=*current_dest.pixel<std::array<float, 2>>(x, y);
+					// whole rows are accumulated per tap, which keeps the reads sequential
+					int first=std::max(0, half-y);
+					int last=std::min<int>(ws.kernel.size(), in.height+half-y);
+					float weights=0;
+
+					std::fill(sum, sum+in.width, std::array<float, 2>{ { 0, 0 } });
+
+					for (int i=first; i<last; ++i)
+					{
+						const auto *src=blur_x->frame.pixel<stat_t>(0, y+i-half);
+						float weight=ws.kernel[i];
+
+						for (int x=0; x<in.width; ++x)
+						{
+							sum[x][0]+=src[x][0]*weight;
+							sum[x][1]+=src[x][1]*weight;
+						}
+
+						weights+=weight;
+					}
+
+					float norm=(weights==0) ? 0 : scale/weights;
 
-					o=ws.operator()<std::array<float, 2>>(x, y, false, math_array(), [&] (int x, int y) { return sampler(*blur_x, x, y); });
+					for (int x=0; x<in.width; ++x)
+						store_linear(*current_dest.pixel<stat_t>(x, y), mul(sum[x], norm));
 				}
-			}
+			});
 		});
+
+	render_passes.back().no_output=bool(dest);
+	render_passes.back().halo=ws.kernel.size()/2;
+	render_passes.back().reads={ blur_x };
+
+	if (dest)
+		render_passes.back().writes={ dest };
 }
 
-parallel_process::render_pass_t black_crush(float black_crush_low, float black_crush_high)
+parallel_process::render_pass_t black_crush(float black_crush_low, float black_crush_high, linear_format format)
 {
+	const int bpp=linear_bpp(format);
+	const stage::black_crush crush(black_crush_low, black_crush_high);
+
 	return
 	{
-		[] (const frame_data &in, parallel_process::render_pass_t &render_pass)
+		[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
 		{
-			render_pass.frame.resize(in.width, in.height, sizeof(float)*3*8);
+			render_pass.frame.resize(in.width, in.height, bpp);
 		},
 		[=] (const frame_data &in, frame_data &out, const render_context &ctx)
 		{
@@ -615,35 +1223,33 @@ parallel_process::render_pass_t black_crush(float black_crush_low, float black_c
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			for (int y=line_start; y<line_end; ++y)
+			dispatch_linear(in.bpp, [&] (auto pixel)
 			{
-				for (int x=0; x<in.width; ++x)
-				{
-					auto linear_color=*in.pixel<std::array<float, 3>>(x, y);
-					auto hsp=rgb_to_hsp(linear_color);
-
-					hsp[2]*=smootherstep(black_crush_low, black_crush_high, hsp[2]);
+				typedef decltype(pixel) pixel_t;
 
-					auto &o=*out.pixel<std::array<float, 3>>(x, y);
-
-					o=hsp_to_rgb(hsp);
+				for (int y=line_start; y<line_end; ++y)
+				{
+					for (int x=0; x<in.width; ++x)
+						store_linear(*out.pixel<pixel_t>(x, y), crush(load_linear(*in.pixel<pixel_t>(x, y)), x, y));
 				}
-			}
-		}
+			});
+		},
+		bpp
 	};
 }
 
 
-void add_local_contrast(std::vector<parallel_process::render_pass_t> &render_passes, float stddev, float gain, float black_crush_high, float black_crush_low)
+void add_local_contrast(std::vector<parallel_process::render_pass_t> &render_passes, float stddev, float gain, float black_crush_high, float black_crush_low, int blur_interval, linear_format format)
 {
-	auto blur=std::make_shared<frame_data_managed>();
+	const int bpp=linear_bpp(format);
+	auto blur=std::make_shared<parallel_process::buffer_t>("lc_blur", stats_bpp(format));
 
-	lc_blur(render_passes, stddev, blur);
+	lc_blur(render_passes, stddev, blur, blur_interval, format);
 
 	render_passes.emplace_back(
-		[] (const frame_data &in, parallel_process::render_pass_t &render_pass)
+		[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
 		{
-			render_pass.frame.resize(in.width, in.height, sizeof(float)*3*8);
+			render_pass.frame.resize(in.width, in.height, bpp);
 		},
 		[=] (const frame_data &in, frame_data &out, const render_context &ctx)
 		{
@@ -651,28 +1257,40 @@ void add_local_contrast(std::vector<parallel_process::render_pass_t> &render_pas
 
 			std::tie(line_start, line_end)=ctx.rows(in.height);
 
-			for (int y=line_start; y<line_end; ++y)
+			dispatch_linear(in.bpp, [&] (auto pixel)
 			{
-				for (int x=0; x<in.width; ++x)
+				typedef decltype(pixel) pixel_t;
+
+				dispatch_stats(blur->frame.bpp, [&] (auto stat, float scale)
 				{
-					auto avg_var=*blur->pixel<std::array<float, 2>>(x, y);
-					auto avg=avg_var[0];
-					auto var=avg_var[1]-avg*avg;
-					auto linear_color=*in.pixel<std::array<float, 3>>(x, y);
-					auto hsp=rgb_to_hsp(linear_color);
+					typedef decltype(stat) stat_t;
+
+					for (int y=line_start; y<line_end; ++y)
+					{
+						for (int x=0; x<in.width; ++x)
+						{
+							auto avg_var=load_linear(*blur->frame.pixel<stat_t>(x, y));
+							auto avg=avg_var[0];
+							auto var=avg_var[1]-avg*avg;
+							auto linear_color=load_linear(*in.pixel<pixel_t>(x, y));
+							auto hsp=rgb_to_hsp(linear_color);
 
-					var=std::max(var, 0.f);
-					hsp[1]=pow(hsp[1], 0.75f);
+							var=std::max(var, 0.f);
+							hsp[1]=pow(hsp[1], 0.75f);
 
-					linear_color=hsp_to_rgb(hsp);
+							linear_color=hsp_to_rgb(hsp);
 
-					auto c=calc_local_contrast(avg, var, linear_color, gain, black_crush_high, black_crush_low);
-					auto &o=*out.pixel<std::array<float, 3>>(x, y);
+							auto c=calc_local_contrast(avg, var, linear_color, gain, black_crush_high, black_crush_low);
 
-					o=c;
-				}
-			}
-		});
+							store_linear(*out.pixel<pixel_t>(x, y), c);
+						}
+					}
+				});
+			});
+		},
+		bpp);
+
+	render_passes.back().reads={ blur };
 }
 
 parallel_process::render_pass_t nearest_scale(int w, int h)
@@ -689,92 +1307,126 @@ parallel_process::render_pass_t nearest_scale(int w, int h)
 
 				std::tie(line_start, line_end)=ctx.rows(in.height);
 
-				for (int y=line_start; y<line_end; ++y)
+				dispatch_linear(in.bpp, [&] (auto pixel)
 				{
-					for (int x=0; x<in.width; ++x)
-					{
-						auto linear_color=*in.pixel<std::array<float, 3>>(x, y);
+					typedef decltype(pixel) pixel_t;
 
-						for (int j=0; j<h; ++j)
+					for (int y=line_start; y<line_end; ++y)
+					{
+						for (int x=0; x<in.width; ++x)
 						{
-							for (int i=0; i<w; ++i)
+							auto linear_color=*in.pixel<pixel_t>(x, y);
+
+							for (int j=0; j<h; ++j)
 							{
-								auto &o=*out.pixel<std::array<float, 3>>(x*w+i, y*h+j);
+								for (int i=0; i<w; ++i)
+								{
+									auto &o=*out.pixel<pixel_t>(x*w+i, y*h+j);
 
-								o=linear_color;
+									o=linear_color;
+								}
 							}
 						}
 					}
-				}
+				});
 			}
 		};
 }
 
 template<class output_algorithm_t>
-parallel_process::render_pass_t nearest<output_algorithm_t>::create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm)
+parallel_process::render_pass_t nearest<output_algorithm_t>::create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm, const nearest_lut_t &lut)
 {
-	nearest<output_algorithm_t> n;
-
-	n.linear_palette=linear_palette;
-	n.output_algorithm=output_algorithm;
-
-	return
-	{
-		[n] (auto &&...args) mutable
-		{
-			return n.init(std::forward<decltype(args)>(args)...);
-		}
-	};
+	return make_static_pipeline<stage::linear_source>(stage::nearest(linear_palette, lut), stage::output<output_algorithm_t>(output_algorithm));
 }
 
 template<class output_algorithm_t>
-void nearest<output_algorithm_t>::init(const frame_data &in, parallel_process::render_pass_t &render_pass)
+parallel_process::render_pass_t bayer_r<output_algorithm_t>::create(const bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const output_algorithm_t &output_algorithm, const bayer::threshold_tile &thresholds)
 {
-	output_algorithm.new_frame(in, render_pass.frame);
-	render_pass.render=[this] (auto &&...args) { this->render(std::forward<decltype(args)>(args)...); };
+	return make_static_pipeline<stage::linear_source>(stage::bayer_r(bayer_map, precomputed_dither, thresholds), stage::output<output_algorithm_t>(output_algorithm));
 }
 
-template<class output_algorithm_t>
-void nearest<output_algorithm_t>::render(const frame_data &in, frame_data &out, const render_context &ctx)
+error_noise error_noise::blue(int size/*=64*/)
 {
-	int line_start, line_end;
+	if (size<=0 || (size & (size-1))!=0)
+		throw std::invalid_argument("blue noise size has to be a power of two");
 
-	std::tie(line_start, line_end)=ctx.rows(in.height);
+	auto ranks=bayer::generate_blue_noise(size, size);
+	auto tile=std::make_shared<std::vector<float>>(ranks.size());
 
-	for (int y=line_start; y<line_end; ++y)
-	{
-		for (int x=0; x<in.width; ++x)
-		{
-			const std::array<float, 3> &linear_color=*in.pixel<std::array<float, 3>>(x, y);
-			std::uint8_t c=eval_nearest_color(linear_palette, linear_color);
+	for (int i=0; i<ranks.size(); ++i)
+		(*tile)[i]=(ranks.values[i]+.5f)/ranks.size();
 
-			output_algorithm.pp(out, x, y, c);
-		}
+	error_noise ret;
+
+	ret.blue_noise=tile;
+	ret.mask=size-1;
+
+	return ret;
+}
+
+template<class output_algorithm_t>
+parallel_process::render_pass_t temporal_error_diffusion<output_algorithm_t>::create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm, const nearest_lut_t &lut, const error_noise &noise)
+{
+	return make_static_pipeline<stage::linear_source>(stage::temporal_error_diffusion(linear_palette, lut, noise), stage::output<output_algorithm_t>(output_algorithm));
+}
+
+//! spins until a row of a wavefront got to value, yielding once the wait gets long
+static void wait_for_progress(const std::atomic<int> &progress, int value)
+{
+	for (int spins=0; progress.load(std::memory_order_acquire)<value; ++spins)
+	{
+		if (spins>=64)
+			std::this_thread::yield();
 	}
 }
 
 template<class output_algorithm_t>
-parallel_process::render_pass_t bayer_r<output_algorithm_t>::create(const bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const output_algorithm_t &output_algorithm)
+parallel_process::render_pass_t error_diffusion<output_algorithm_t>::create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm, const nearest_lut_t &lut, bool serpentine, float temporal_weight)
 {
-	bayer_r n;
+	auto n=std::make_shared<error_diffusion>();
 
-	n.bayer_map=bayer_map;
-	n.precomputed_dither=precomputed_dither;
-	n.output_algorithm=output_algorithm;
+	n->palette=linear_palette;
+	n->linear_palette=nearest_palette(linear_palette);
+	n->lut=lut;
+	n->serpentine=serpentine;
+	n->temporal_weight=temporal_weight;
+	n->output_algorithm=output_algorithm;
 
-	return
-	{
-		[n] (auto &&...args) mutable
+	parallel_process::render_pass_t render_pass(
+		[n] (auto &&...args)
 		{
-			return n.init(std::forward<decltype(args)>(args)...);
-		}
-	};
+			return n->init(std::forward<decltype(args)>(args)...);
+		});
+
+	render_pass.temporal=output_algorithm_t::temporal || temporal_weight>0;
+	render_pass.wavefront=true;
+
+	return render_pass;
 }
 
 template<class output_algorithm_t>
-void bayer_r<output_algorithm_t>::init(const frame_data &in, parallel_process::render_pass_t &render_pass)
+void error_diffusion<output_algorithm_t>::init(const frame_data &in, parallel_process::render_pass_t &render_pass)
 {
 	output_algorithm.new_frame(in, render_pass.frame);
+
+	// the first row never receives any error, and the held back error only carries over between frames of the same mode
+	if (spatial_error.width!=in.width+2 || spatial_error.height!=in.height)
+	{
+		spatial_error.resize(in.width+2, in.height, sizeof(std::array<float, 3>)*8);
+		temporal_error.resize(in.width, in.height, sizeof(std::array<float, 3>)*8);
+		spatial_error.clear();
+		temporal_error.clear();
+	}
+
+	if (progress_rows!=in.height)
+	{
+		progress.reset(new std::atomic<int>[in.height]);
+		progress_rows=in.height;
+	}
+
+	for (int y=0; y<in.height; ++y)
+		progress[y].store(0, std::memory_order_relaxed);
+
 	render_pass.render=[this] (auto &&...args)
 	{
 		return this->render(std::forward<decltype(args)>(args)...);
@@ -782,48 +1434,147 @@ void bayer_r<output_algorithm_t>::init(const frame_data &in, parallel_process::r
 }
 
 template<class output_algorithm_t>
-void bayer_r<output_algorithm_t>::render(const frame_data &in, frame_data &out, const render_context &ctx)
+void error_diffusion<output_algorithm_t>::render(const frame_data &in, frame_data &out, const render_context &ctx)
 {
-	int line_start, line_end;
-
-	std::tie(line_start, line_end)=ctx.rows(in.height);
+	// rows of the first phase that reaches a row were already diffused into it, or belong to the previous frame
+	const int first=(ctx.row_end<0) ? 0 : ctx.row_begin;
+	const int end=(ctx.row_end<0) ? in.height : ctx.row_end;
+	const int segments=(in.width+segment_width-1)/segment_width;
+	const std::array<float, 3> zero={ { 0, 0, 0 } };
 
-	for (int y=line_start; y<line_end; ++y)
+	dispatch_linear(in.bpp, [&] (auto pixel)
 	{
-		for (int x=0; x<in.width; ++x)
+		typedef decltype(pixel) pixel_t;
+
+		for (int y=first+ctx.thread_idx; y<end; y+=ctx.num_threads)
 		{
-			const std::array<float, 3> &linear_color=*in.pixel<std::array<float, 3>>(x, y);
-			auto dc=precomputed_dither.get(linear_color);
-			std::uint8_t c=dc.get_dithered(bayer_map, x, y);
+			const auto *current=spatial_error.pixel<std::array<float, 3>>(1, y);
+			auto *below=(y+1<in.height) ? spatial_error.pixel<std::array<float, 3>>(1, y+1) : nullptr;
+			const bool reverse=serpentine && y%2==1;
+			const int dir=reverse ? -1 : 1;
+			auto carry=zero;
+
+			if (below)
+				std::fill(below-1, below+in.width+1, zero);
+
+			for (int s=0; s<segments; ++s)
+			{
+				const int x_begin=s*segment_width;
+				const int x_end=std::min(in.width, x_begin+segment_width);
+
+				// everything diffusing into this segment comes from up to one segment further right
+				if (y>first)
+					wait_for_progress(progress[y-1], std::min(segments, s+2));
+
+				if (reverse)
+					carry=zero;
+
+				for (int i=x_begin; i<x_end; ++i)
+				{
+					const int x=reverse ? x_begin+x_end-1-i : i;
+					auto &held=*temporal_error.pixel<std::array<float, 3>>(x, y);
+					auto target=clamp(add(add(load_linear(*in.pixel<pixel_t>(x, y)), current[x]), add(carry, held)));
+					std::uint8_t c=lut.empty() ? linear_palette(target) : lut.get(target);
+					auto error=sub(target, palette[c]);
 
-			output_algorithm.pp(out, x, y, c);
+					output_algorithm.pp(out, x, y, c);
+
+					if (temporal_weight>0)
+					{
+						held=mul(error, temporal_weight);
+						error=mul(error, 1-temporal_weight);
+					}
+
+					const bool forward=reverse ? x>x_begin : x+1<in.width;
+
+					carry=forward ? mul(error, 7/16.f) : zero;
+
+					if (below)
+					{
+						add_ref(below[x-dir], mul(error, 3/16.f));
+						add_ref(below[x], mul(error, forward ? 5/16.f : 12/16.f));
+						add_ref(below[x+dir], mul(error, 1/16.f));
+					}
+				}
+
+				progress[y].store(s+1, std::memory_order_release);
+			}
 		}
-	}
+	});
 }
 
 template<class output_algorithm_t>
-parallel_process::render_pass_t temporal_error_diffusion<output_algorithm_t>::create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm)
+parallel_process::render_pass_t direct_lookup<output_algorithm_t>::create(const bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const output_algorithm_t &output_algorithm, const bayer::threshold_tile &thresholds)
 {
-	auto n=std::make_shared<temporal_error_diffusion>();
+	direct_lookup n;
 
-	n->linear_palette=linear_palette;
-	n->output_algorithm=output_algorithm;
+	n.bayer_map=bayer_map;
+	n.thresholds=thresholds;
+	n.precomputed_dither=precomputed_dither;
+	n.output_algorithm=output_algorithm;
+	n.build_indices(precomputed_dither.channels);
 
-	return
+	return make_pass(n);
+}
+
+template<class output_algorithm_t>
+parallel_process::render_pass_t direct_lookup<output_algorithm_t>::create(const nearest_lut_t &lut, const output_algorithm_t &output_algorithm)
+{
+	direct_lookup n;
+
+	n.lut=lut;
+	n.output_algorithm=output_algorithm;
+	n.build_indices(lut.channels);
+
+	return make_pass(n);
+}
+
+template<class output_algorithm_t>
+parallel_process::render_pass_t direct_lookup<output_algorithm_t>::make_pass(direct_lookup n)
+{
+	parallel_process::render_pass_t render_pass(
+		[n] (auto &&...args) mutable
+		{
+			return n.init(std::forward<decltype(args)>(args)...);
+		},
+		nullptr,
+		output_algorithm_t::bpp);
+
+	// binds render and sizes the threshold tile
+	render_pass.init_every_frame=true;
+	render_pass.temporal=output_algorithm_t::temporal;
+
+	return render_pass;
+}
+
+template<class output_algorithm_t>
+void direct_lookup<output_algorithm_t>::build_indices(const std::array<srgb_quantizer, 3> &channels)
+{
+	const int shifts[3]={ channels[1].bits+channels[2].bits, channels[2].bits, 0 };
+	const int shifts_16[3]={ fmt_r5g6b5.g+fmt_r5g6b5.b, fmt_r5g6b5.b, 0 };
+	const int bits_16[3]={ fmt_r5g6b5.r, fmt_r5g6b5.g, fmt_r5g6b5.b };
+
+	for (int c=0; c<3; ++c)
 	{
-		[n] (auto &&...args)
+		for (int v=0; v<256; ++v)
 		{
-			return n->init(std::forward<decltype(args)>(args)...);
+			// a pixel holding only this channel, to go through the same conversions as linearize()
+			auto linear_16=to_linear(to_float_srgb(fmt_r5g6b5, std::uint16_t((v & ((1 << bits_16[c])-1)) << shifts_16[c])));
+			auto linear_32=to_linear(to_float_srgb(fmt_a8r8g8b8, std::uint32_t(v) << (8*(2-c))));
+
+			indices_16[c][v]=std::uint32_t(channels[c](linear_16[c])) << shifts[c];
+			indices_32[c][v]=std::uint32_t(channels[c](linear_32[c])) << shifts[c];
 		}
-	};
+	}
 }
 
 template<class output_algorithm_t>
-void temporal_error_diffusion<output_algorithm_t>::init(const frame_data &in, parallel_process::render_pass_t &render_pass)
+void direct_lookup<output_algorithm_t>::init(const frame_data &in, parallel_process::render_pass_t &render_pass)
 {
 	output_algorithm.new_frame(in, render_pass.frame);
-	error.resize(in.width, in.height, sizeof(std::array<float, 3>)*8);
-	prev_pixel.resize(in.width, in.height, sizeof(std::array<float, 3>)*8);
+
+	if (bayer_map && thresholds.width!=in.width)
+		thresholds=bayer_map.thresholds(in.width, packed_dithered_color::mix_levels);
 	render_pass.render=[this] (auto &&...args)
 	{
 		return this->render(std::forward<decltype(args)>(args)...);
@@ -831,40 +1582,52 @@ void temporal_error_diffusion<output_algorithm_t>::init(const frame_data &in, pa
 }
 
 template<class output_algorithm_t>
-void temporal_error_diffusion<output_algorithm_t>::render(const frame_data &in, frame_data &out, const render_context &ctx)
+void direct_lookup<output_algorithm_t>::render(const frame_data &in, frame_data &out, const render_context &ctx)
 {
 	int line_start, line_end;
 
 	std::tie(line_start, line_end)=ctx.rows(in.height);
 
-	for (int y=line_start; y<line_end; ++y)
-	{
-		for (int x=0; x<in.width; ++x)
-		{
-			const std::array<float, 3> &linear_color=*in.pixel<std::array<float, 3>>(x, y);
-			auto &linear_error=*error.pixel<std::array<float, 3>>(x, y);
-			auto &prev=*prev_pixel.pixel<std::array<float, 3>>(x, y);
-			auto cga_idx=eval_nearest_color(linear_palette, clamp(add(linear_color, linear_error)));
+	if (in.bpp==16)
+		render_rows<std::uint16_t>(in, out, indices_16, { fmt_r5g6b5.g+fmt_r5g6b5.b, fmt_r5g6b5.b, 0 }, { (1 << fmt_r5g6b5.r)-1, (1 << fmt_r5g6b5.g)-1, (1 << fmt_r5g6b5.b)-1 }, line_start, line_end);
+	else if (in.bpp==32)
+		render_rows<std::uint32_t>(in, out, indices_32, { 16, 8, 0 }, { 0xff, 0xff, 0xff }, line_start, line_end);
+}
 
-			output_algorithm.pp(out, x, y, cga_idx);
+template<class output_algorithm_t>
+template<class storage_type>
+void direct_lookup<output_algorithm_t>::render_rows(const frame_data &in, frame_data &out, const channel_indices_t &indices, const std::array<int, 3> &shifts, const std::array<int, 3> &masks, int line_start, int line_end)
+{
+	std::array<packed_dithered_color, 64> entries;
+	std::array<std::uint8_t, 64> colors;
 
-			auto current_error=sub(linear_color, cga_palette()[cga_idx]);
+	auto index=[&] (storage_type pixel)
+	{
+		return indices[0][(pixel >> shifts[0]) & masks[0]] | indices[1][(pixel >> shifts[1]) & masks[1]] | indices[2][(pixel >> shifts[2]) & masks[2]];
+	};
 
-			add_ref(linear_error, current_error);
+	for (int y=line_start; y<line_end; ++y)
+	{
+		const auto *row=in.pixel<storage_type>(0, y);
 
-			if (prev!=linear_color)
-			{
-				for (int i=0; i<3; ++i)
-				{
-					float v=rand()/float(RAND_MAX);
+		for (int x_begin=0; x_begin<in.width; x_begin+=int(entries.size()))
+		{
+			int count=std::min(int(entries.size()), in.width-x_begin);
 
-					linear_error[i]+=v*current_error[i];
-				}
+			if (!lut.empty())
+			{
+				for (int i=0; i<count; ++i)
+					colors[i]=lut.lookup->data[index(row[x_begin+i])];
+			}
+			else
+			{
+				for (int i=0; i<count; ++i)
+					entries[i]=precomputed_dither.lookup[index(row[x_begin+i])];
 
-				prev=linear_color;
+				dither_row(entries.data(), thresholds.row(y)+x_begin, count, colors.data());
 			}
 
-			clamp_ref(linear_error);
+			output_algorithm.write_row(out, x_begin, y, colors.data(), count);
 		}
 	}
 }
@@ -895,3 +1658,21 @@ struct temporal_error_diffusion<temporal_dither_output>;
 
 template
 struct temporal_error_diffusion<async_temporal_dither_output>;
+
+template
+struct error_diffusion<normal_output>;
+
+template
+struct error_diffusion<temporal_dither_output>;
+
+template
+struct error_diffusion<async_temporal_dither_output>;
+
+template
+struct direct_lookup<normal_output>;
+
+template
+struct direct_lookup<temporal_dither_output>;
+
+template
+struct direct_lookup<async_temporal_dither_output>;
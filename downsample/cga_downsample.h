@@ -13,6 +13,71 @@
 
 #include "parallel_process.h"
 #include "bayer.h"
+#include "nearest_palette.h"
+#include "table_storage.h"
+
+// Linear colors handed between passes are floats, or 16 bit fixed point to halve the memory
+// they take. Every pass still computes in float, so fixed point only pays off where memory
+// bandwidth rather than the conversions is the limit. Passes reading linear colors tell the
+// format apart by the bpp of their input.
+enum class linear_format
+{
+	float32,
+	fixed16,
+};
+
+typedef std::array<std::uint16_t, 3> fixed_color; //!< 0..65535 for 0..1
+
+inline int linear_bpp(linear_format format)
+{
+	return (format==linear_format::fixed16) ? sizeof(fixed_color)*8 : sizeof(std::array<float, 3>)*8;
+}
+
+//! bpp of the luminance statistics of lc_blur, mean and mean square
+inline int stats_bpp(linear_format format)
+{
+	return (format==linear_format::fixed16) ? sizeof(std::uint16_t)*2*8 : sizeof(float)*2*8;
+}
+
+template<std::size_t n>
+inline std::array<float, n> load_linear(const std::array<float, n> &v)
+{
+	return v;
+}
+
+template<std::size_t n>
+inline std::array<float, n> load_linear(const std::array<std::uint16_t, n> &v)
+{
+	std::array<float, n> ret;
+
+	for (std::size_t i=0; i<n; ++i)
+		ret[i]=v[i]*(1/65535.f);
+
+	return ret;
+}
+
+template<std::size_t n>
+inline void store_linear(std::array<float, n> &o, const std::array<float, n> &v)
+{
+	o=v;
+}
+
+template<std::size_t n>
+inline void store_linear(std::array<std::uint16_t, n> &o, const std::array<float, n> &v)
+{
+	for (std::size_t i=0; i<n; ++i)
+		o[i]=std::uint16_t(std::max(0.f, std::min(1.f, v[i]))*65535+.5f);
+}
+
+//! calls func with a pixel of the linear format stored at bpp, to pick the type from
+template<class func_t>
+inline void dispatch_linear(int bpp, func_t &&func)
+{
+	if (bpp==linear_bpp(linear_format::fixed16))
+		func(fixed_color());
+	else
+		func(std::array<float, 3>());
+}
 
 // returns IRGB
 extern std::uint8_t eval_nearest_color(const std::vector<std::array<float, 3>> &linear_palette, const std::array<float, 3> &linear_color, float *best_distance_out=nullptr);
@@ -81,10 +146,109 @@ inline static bool allowed_dither(int left, int right)
 
 extern dithered_color eval_nearest_dithered_color(const std::vector<std::array<float, 3>> &linear_palette, const std::function<bool(int, int)> &allowed_dither, const std::array<float, 3> &linear_color, float *best_distance_out=nullptr);
 
+// The allowed pairs of a palette in a bounding volume hierarchy. Finds the same dithered
+// color as eval_nearest_dithered_color, bit for bit, but skips every group of pairs whose
+// bounding box is farther away than the best candidate so far.
+struct dither_pair_index
+{
+	static const int leaf_size=8;
+
+	struct pair_t
+	{
+		std::uint8_t left=0;
+		std::uint8_t right=0;
+		int order=0; //!< position in the order eval_nearest_dithered_color visits pairs, breaks ties
+	};
+
+	struct node_t
+	{
+		std::array<float, 3> min;
+		std::array<float, 3> max;
+		int begin=0; //!< range of pairs for leaves
+		int end=0;
+		int children[2]={ -1, -1 };
+	};
+
+	std::vector<std::array<float, 3>> linear_palette;
+	std::vector<pair_t> pairs;
+	std::vector<node_t> nodes;
+
+	dither_pair_index(const std::vector<std::array<float, 3>> &linear_palette, const std::function<bool(int, int)> &allowed_dither);
+
+	dithered_color operator()(const std::array<float, 3> &linear_color, float *best_distance_out=nullptr) const;
+
+private:
+	int build(int begin, int end);
+};
+
+// Level of a linear channel value after conversion to sRGB with the given number of bits,
+// without evaluating the transfer function per value.
+struct srgb_quantizer
+{
+	static const int buckets=4096;
+
+	int bits=0;
+	std::vector<float> thresholds; //!< linear value at which level q+1 begins
+	std::vector<std::uint8_t> bucket_levels; //!< level of the lower end of each bucket
+
+	srgb_quantizer(int bits=8);
+
+	int operator()(float linear_value) const
+	{
+		float v=std::max(0.f, std::min(1.f, linear_value));
+		int q=bucket_levels[std::min(buckets-1, int(v*buckets))];
+
+		while (v>=thresholds[q])
+			++q;
+
+		return q;
+	}
+
+	int levels() const
+	{
+		return 1 << bits;
+	}
+};
+
+//! dithered_color as kept in dither_lut_t, with mix in steps of 1/mix_levels
+struct packed_dithered_color
+{
+	static const int mix_levels=255;
+
+	std::uint8_t left_color=0;
+	std::uint8_t right_color=0;
+	std::uint8_t mix=0;
+	std::uint8_t reserved=0;
+
+	packed_dithered_color()
+	{
+
+	}
+
+	packed_dithered_color(const dithered_color &c)
+		: left_color(c.left_color), right_color(c.right_color), mix(std::uint8_t(c.mix*mix_levels+.5f))
+	{
+
+	}
+
+	operator dithered_color() const
+	{
+		return { left_color, right_color, mix*(1.f/mix_levels) };
+	}
+};
+
+// Dithered color of every r5g6b5 color. The mix is the one of the color at the center of
+// each cell, or of the palette color in it, so a lookup is a table load and no geometry.
+// Copies share the table, which may be mapped from a cache file.
 struct dither_lut_t
 {
+	//! bump whenever the entries or the way they're built change, so old cache files are ignored
+	static const std::uint32_t cache_version=2;
+
 	std::vector<std::array<float, 3>> linear_palette;
-	std::vector<dithered_color> lookup;
+	std::shared_ptr<const table_storage> storage;
+	const packed_dithered_color *lookup=nullptr;
+	std::array<srgb_quantizer, 3> channels;
 
 	static constexpr auto pixel_fmt()
 	{
@@ -93,15 +257,100 @@ struct dither_lut_t
 
 	dither_lut_t();
 	dither_lut_t(const std::vector<std::array<float, 3>> &linear_palette, const std::function<dithered_color(const std::array<float, 3> &)> &dither_lookup);
+	//! builds the table on the workers of pp instead of spawning its own
+	dither_lut_t(parallel_process &pp, const std::vector<std::array<float, 3>> &linear_palette, const std::function<dithered_color(const std::array<float, 3> &)> &dither_lookup);
+	//! Maps the table from a file in cache_dir if one was saved for the same palette, lookup_id
+	//! and pixel format, otherwise builds it and saves it there. lookup_id stands in for
+	//! dither_lookup, which can't be compared, so it has to change whenever dither_lookup does.
+	dither_lut_t(parallel_process &pp, const std::vector<std::array<float, 3>> &linear_palette, const std::function<dithered_color(const std::array<float, 3> &)> &dither_lookup, const std::string &cache_dir, const std::string &lookup_id);
+
+	static std::size_t size()
+	{
+		return std::size_t(1) << pixel_fmt().visible_bits();
+	}
 
-	dithered_color get(const std::array<float, 3> &linear_color) const;
+	//! hash of everything the entries depend on
+	std::uint64_t cache_key(const std::string &lookup_id) const;
+	std::string cache_path(const std::string &cache_dir, const std::string &lookup_id) const;
+	bool load(const std::string &path, std::uint64_t key);
+	bool save(const std::string &path, std::uint64_t key) const;
+
+	std::uint32_t index(const std::array<float, 3> &linear_color) const
+	{
+		return (std::uint32_t(channels[0](linear_color[0])) << (pixel_fmt().g+pixel_fmt().b)) |
+			(std::uint32_t(channels[1](linear_color[1])) << pixel_fmt().b) |
+			std::uint32_t(channels[2](linear_color[2]));
+	}
+
+	const packed_dithered_color &entry(const std::array<float, 3> &linear_color) const
+	{
+		return lookup[index(linear_color)];
+	}
+
+	dithered_color get(const std::array<float, 3> &linear_color) const
+	{
+		return entry(linear_color);
+	}
+};
+
+//! right_color where the mix of an entry reaches its threshold, left_color elsewhere, see bayer::threshold_tile
+extern void dither_row(const packed_dithered_color *entries, const std::uint8_t *thresholds, int count, std::uint8_t *out);
+
+//! packs an even count of 4 bit colors two to a byte, the even pixel in the low nibble
+extern void pack_nibbles(const std::uint8_t *colors, int count, std::uint8_t *out);
+
+enum class lut_precision
+{
+	r5g6b5,
+	r6g6b6,
+	r8g8b8,
+};
+
+//! parses "565", "666" or "888"
+extern lut_precision parse_lut_precision(const std::string &s);
+
+// Nearest palette color of every quantized sRGB color, so quantizing a pixel is one table
+// load. Exact for colors on the quantization grid, elsewhere it may pick a color that is
+// only nearest to a neighbouring grid point. Copies share the table.
+struct nearest_lut_t
+{
+	std::vector<std::array<float, 3>> linear_palette;
+	std::array<srgb_quantizer, 3> channels;
+	std::shared_ptr<const table_storage> lookup;
+
+	nearest_lut_t();
+	//! builds the table on the workers of pp
+	nearest_lut_t(parallel_process &pp, const std::vector<std::array<float, 3>> &linear_palette, lut_precision precision);
+
+	bool empty() const
+	{
+		return !lookup;
+	}
+
+	std::uint32_t index(const std::array<float, 3> &linear_color) const
+	{
+		return (std::uint32_t(channels[0](linear_color[0])) << (channels[1].bits+channels[2].bits)) |
+			(std::uint32_t(channels[1](linear_color[1])) << channels[2].bits) |
+			std::uint32_t(channels[2](linear_color[2]));
+	}
+
+	//! linear color of the grid point at index
+	std::array<float, 3> grid_color(std::uint32_t index) const;
+
+	std::uint8_t get(const std::array<float, 3> &linear_color) const
+	{
+		return lookup->data[index(linear_color)];
+	}
 };
 
 struct normal_output
 {
-	static void new_frame(const frame_data &in, frame_data_managed &out)
+	static const int bpp=4;
+	static const bool temporal=false;
+
+	static void new_frame(const frame_data &in, pooled_frame &out)
 	{
-		out.resize(in.width, in.height, 4);
+		out.resize(in.width, in.height, bpp);
 		out.aspect_ratio=in.aspect_ratio;
 	}
 
@@ -114,6 +363,21 @@ struct normal_output
 		o&=~(((1 << 4)-1) << shl);
 		o|=color << shl;
 	}
+
+	//! count colors starting at (x, y); only a pixel without its neighbor in the run shares a byte with other writes
+	static void write_row(frame_data &out, int x, int y, const std::uint8_t *colors, int count)
+	{
+		if (count>0 && x%2==1)
+		{
+			pp(out, x++, y, *colors++);
+			--count;
+		}
+
+		pack_nibbles(colors, count & ~1, out.pixel<std::uint8_t>(x, y));
+
+		if (count%2==1)
+			pp(out, x+count-1, y, colors[count-1]);
+	}
 };
 
 struct temporal_dither_output
@@ -122,11 +386,26 @@ struct temporal_dither_output
 	int frame_count=0;
 	bool staggered=false;
 
-	void new_frame(const frame_data &in, frame_data_managed &out)
+	static const int bpp=4;
+	static const bool temporal=true; //!< alternates between the two colors of a pair every frame
+
+	std::vector<std::uint8_t> shown; //!< color this frame shows for a pair index, then for the index on swapped pixels
+
+	void new_frame(const frame_data &in, pooled_frame &out)
 	{
-		out.resize(in.width, in.height, 4);
+		out.resize(in.width, in.height, bpp);
 		out.aspect_ratio=in.aspect_ratio;
 		++frame_count;
+
+		const int n=indices.size();
+
+		shown.resize(2*n);
+
+		for (int i=0; i<n; ++i)
+		{
+			shown[i]=(frame_count%2==0) ? indices[i].first : indices[i].second;
+			shown[n+i]=(frame_count%2==0) ? indices[i].second : indices[i].first;
+		}
 	}
 
 	void pp(frame_data &out, int x, int y, std::uint8_t color)
@@ -138,6 +417,26 @@ struct temporal_dither_output
 
 		normal_output::pp(out, x, y, (frame_count%2==0) ? p.first : p.second);
 	}
+
+	void write_row(frame_data &out, int x, int y, const std::uint8_t *colors, int count) const
+	{
+		std::array<std::uint8_t, 64> run;
+		const int n=indices.size();
+
+		for (int begin=0; begin<count; begin+=int(run.size()))
+		{
+			const int run_count=std::min(int(run.size()), count-begin);
+
+			for (int i=0; i<run_count; ++i)
+			{
+				const bool swapped=staggered && ((x+begin+i+y)%2)==1;
+
+				run[i]=shown[(swapped ? n : 0)+colors[begin+i]];
+			}
+
+			normal_output::write_row(out, x+begin, y, run.data(), run_count);
+		}
+	}
 };
 
 struct async_temporal_dither_output
@@ -146,11 +445,26 @@ struct async_temporal_dither_output
 	int frame_count=0;
 	bool staggered=false;
 
-	void new_frame(const frame_data &in, frame_data_managed &out)
+	static const int bpp=8;
+	static const bool temporal=false;
+
+	std::vector<std::uint8_t> packed; //!< output byte of a pair index, then of the index on swapped pixels
+
+	void new_frame(const frame_data &in, pooled_frame &out)
 	{
-		out.resize(in.width, in.height, 8);
+		out.resize(in.width, in.height, bpp);
 		out.aspect_ratio=in.aspect_ratio;
 		++frame_count;
+
+		const int n=indices.size();
+
+		packed.resize(2*n);
+
+		for (int i=0; i<n; ++i)
+		{
+			packed[i]=(indices[i].first << 4)+indices[i].second;
+			packed[n+i]=(indices[i].second << 4)+indices[i].first;
+		}
 	}
 
 	void pp(frame_data &out, int x, int y, std::uint8_t color)
@@ -163,54 +477,170 @@ struct async_temporal_dither_output
 		else
 			o=(p.second << 4)+p.first;
 	}
+
+	void write_row(frame_data &out, int x, int y, const std::uint8_t *colors, int count) const
+	{
+		auto *o=out.pixel<std::uint8_t>(x, y);
+		const auto *even=packed.data();
+		const auto *odd=packed.data()+(staggered ? indices.size() : 0);
+
+		// tables of the pixels whose x parity matches y and of the others
+		if ((x+y)%2==1)
+			std::swap(even, odd);
+
+		int i=0;
+
+		for (; i+2<=count; i+=2)
+		{
+			o[i]=even[colors[i]];
+			o[i+1]=odd[colors[i+1]];
+		}
+
+		if (i<count)
+			o[i]=even[colors[i]];
+	}
 };
 
+// The final passes below read linear colors and are the matching stages of static_pipeline.h
+// behind stage::linear_source, written through output_algorithm.
 template<class output_algorithm_t=normal_output>
 struct nearest
 {
-	output_algorithm_t output_algorithm;
-	std::vector<std::array<float, 3>> linear_palette;
+	//! a non-empty lut replaces the palette search
+	static parallel_process::render_pass_t create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm=output_algorithm_t(), const nearest_lut_t &lut=nearest_lut_t());
+};
 
-	static parallel_process::render_pass_t create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm=output_algorithm_t());
+template<class output_algorithm_t=normal_output>
+struct bayer_r
+{
+	//! thresholds of bayer_map built ahead for the expected width, see stage::bayer_r
+	static parallel_process::render_pass_t create(const bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const output_algorithm_t &output_algorithm=output_algorithm_t(), const bayer::threshold_tile &thresholds=bayer::threshold_tile());
+};
 
-	void init(const frame_data &in, parallel_process::render_pass_t &render_pass);
-	void render(const frame_data &in, frame_data &out, const render_context &ctx);
+// Random share of the error that temporal error diffusion feeds back into pixels whose color
+// changed. Values only depend on frame, position and channel, so the output is the same no
+// matter which worker renders a row.
+struct error_noise
+{
+	std::shared_ptr<const std::vector<float>> blue_noise; //!< size*size tile, hashed white noise when null
+	int mask=0; //!< size-1
+
+	//! tile of a power of two size, shifted around by frame and channel
+	static error_noise blue(int size=64);
+
+	static std::uint32_t hash(std::uint32_t v)
+	{
+		v^=v >> 16;
+		v*=0x7feb352du;
+		v^=v >> 15;
+		v*=0x846ca68bu;
+		v^=v >> 16;
+
+		return v;
+	}
+
+	//! in [0, 1)
+	float operator()(std::uint32_t frame, int x, int y, int channel) const
+	{
+		auto h=hash(frame*3+channel);
+
+		if (blue_noise)
+			return (*blue_noise)[(((y+(h >> 16)) & mask)*(mask+1))+((x+h) & mask)];
+
+		return (hash(h+hash(std::uint32_t(y)*0x10000u+std::uint32_t(x))) >> 8)*(1.f/(1 << 24));
+	}
 };
 
 template<class output_algorithm_t=normal_output>
-struct bayer_r
+struct temporal_error_diffusion
 {
-	output_algorithm_t output_algorithm;
-	bayer::map bayer_map;
-	dither_lut_t precomputed_dither;
+	//! a non-empty lut replaces the palette search
+	static parallel_process::render_pass_t create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm=output_algorithm_t(), const nearest_lut_t &lut=nearest_lut_t(), const error_noise &noise=error_noise());
+};
 
-	static parallel_process::render_pass_t create(const bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const output_algorithm_t &output_algorithm=output_algorithm_t());
+// Floyd-Steinberg error diffusion. Workers take interleaved rows and follow the row above them
+// at a distance of two segments. With serpentine set, every other row runs right to left within
+// each segment, where the error that would cross into the finished segment goes straight down.
+// A temporal_weight above 0 holds back that share of each pixel's error for the same pixel of
+// the next frame.
+template<class output_algorithm_t=normal_output>
+struct error_diffusion
+{
+	static const int segment_width=16;
+
+	output_algorithm_t output_algorithm;
+	std::vector<std::array<float, 3>> palette;
+	nearest_palette linear_palette;
+	nearest_lut_t lut;
+	bool serpentine=true;
+	float temporal_weight=0;
+	pooled_frame spatial_error; //!< error diffused into each row from the row above, with a pixel of padding on both sides
+	pooled_frame temporal_error;
+	std::unique_ptr<std::atomic<int>[]> progress; //!< finished segments by row
+	int progress_rows=0;
+
+	//! a non-empty lut replaces the palette search
+	static parallel_process::render_pass_t create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm=output_algorithm_t(), const nearest_lut_t &lut=nearest_lut_t(), bool serpentine=true, float temporal_weight=0);
 
 	void init(const frame_data &in, parallel_process::render_pass_t &render_pass);
 	void render(const frame_data &in, frame_data &out, const render_context &ctx);
 };
 
+// Bayer dithering or nearest color lookup straight from 16 or 32 bpp input, for pass lists
+// that do nothing else in linear space. Every input channel value maps to its share of the
+// table index through a small table built along the path linearize() and the table's
+// quantizer take, so the output is that of linearize() followed by bayer_r or nearest.
 template<class output_algorithm_t=normal_output>
-struct temporal_error_diffusion
+struct direct_lookup
 {
+	typedef std::array<std::array<std::uint32_t, 256>, 3> channel_indices_t;
+
 	output_algorithm_t output_algorithm;
-	frame_data_managed error;
-	frame_data_managed prev_pixel;
-	std::vector<std::array<float, 3>> linear_palette;
+	bayer::map bayer_map;
+	bayer::threshold_tile thresholds;
+	dither_lut_t precomputed_dither; //!< used unless lut is set
+	nearest_lut_t lut;
+	channel_indices_t indices_16;
+	channel_indices_t indices_32;
 
-	static parallel_process::render_pass_t create(const std::vector<std::array<float, 3>> &linear_palette, const output_algorithm_t &output_algorithm=output_algorithm_t());
+	static parallel_process::render_pass_t create(const bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const output_algorithm_t &output_algorithm=output_algorithm_t(), const bayer::threshold_tile &thresholds=bayer::threshold_tile());
+	static parallel_process::render_pass_t create(const nearest_lut_t &lut, const output_algorithm_t &output_algorithm=output_algorithm_t());
 
 	void init(const frame_data &in, parallel_process::render_pass_t &render_pass);
 	void render(const frame_data &in, frame_data &out, const render_context &ctx);
+
+private:
+	void build_indices(const std::array<srgb_quantizer, 3> &channels);
+	template<class storage_type>
+	void render_rows(const frame_data &in, frame_data &out, const channel_indices_t &indices, const std::array<int, 3> &shifts, const std::array<int, 3> &masks, int line_start, int line_end);
+	static parallel_process::render_pass_t make_pass(direct_lookup n);
 };
 
+// adapted from https://en.wikipedia.org/wiki/Smoothstep
+inline float clamp(float x, float lowerlimit, float upperlimit)
+{
+    if (x < lowerlimit) x = lowerlimit;
+    if (x > upperlimit) x = upperlimit;
+    return x;
+}
+
+// adapted from https://en.wikipedia.org/wiki/Smoothstep
+inline float smootherstep(float edge0, float edge1, float x)
+{
+    // Scale, and clamp x to 0..1 range
+    x = clamp((x - edge0)/(edge1 - edge0), 0.0, 1.0);
+    // Evaluate polynomial
+    return x*x*x*(x*(x*6 - 15) + 10);
+}
+
 extern std::array<float, 3> srgb_from_image(const frame_data &in, int x, int y);
 extern std::array<float, 3> local_contrast(const frame_data &img, int x, int y, float stddev, float gain);
-extern parallel_process::render_pass_t linearize();
+extern parallel_process::render_pass_t linearize(linear_format format=linear_format::float32);
 template<class storage_type>
 extern parallel_process::render_pass_t unlinearize(const pixel_format<storage_type> &fmt);
 extern parallel_process::render_pass_t nearest_scale(int w, int h);
-extern parallel_process::render_pass_t black_crush(float black_crush_low=0, float black_crush_high=0.015f);
-extern void add_local_contrast(std::vector<parallel_process::render_pass_t> &passes, float stddev, float gain, float black_crush_high=0.015f, float black_crush_low=0);
+extern parallel_process::render_pass_t black_crush(float black_crush_low=0, float black_crush_high=0.015f, linear_format format=linear_format::float32);
+//! blur_interval>1 reuses the blurred statistics of the last recomputation for that many frames
+extern void add_local_contrast(std::vector<parallel_process::render_pass_t> &passes, float stddev, float gain, float black_crush_high=0.015f, float black_crush_low=0, int blur_interval=1, linear_format format=linear_format::float32);
 
 #endif /* CGA_DOWNSAMPLE_H */
@@ -0,0 +1,135 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+#if __linux__
+#include <sys/mman.h>
+#endif
+
+#include "frame_pool.h"
+
+const std::size_t frame_pool::alignment;
+const std::size_t frame_pool::huge_page_size;
+
+frame_pool &frame_pool::instance()
+{
+	// never destroyed, so that pooled frames with static storage can still release into it at exit
+	static frame_pool *pool=new frame_pool;
+
+	return *pool;
+}
+
+std::uint8_t *frame_pool::acquire(std::size_t bytes, std::size_t &capacity)
+{
+	std::lock_guard<std::mutex> l(mutex);
+
+	// best fit among released blocks
+	auto best=free_blocks.end();
+
+	for (auto i=free_blocks.begin(); i!=free_blocks.end(); ++i)
+	{
+		if (i->first>=bytes && (best==free_blocks.end() || i->first<best->first))
+			best=i;
+	}
+
+	if (best!=free_blocks.end())
+	{
+		auto *block=best->second;
+
+		capacity=best->first;
+		free_blocks.erase(best);
+
+		return block;
+	}
+
+	const bool huge=huge_pages && bytes>=huge_page_size;
+	const std::size_t block_alignment=huge ? huge_page_size : alignment;
+	void *block=nullptr;
+
+	capacity=(bytes+block_alignment-1)/block_alignment*block_alignment;
+
+	if (posix_memalign(&block, block_alignment, capacity))
+		throw std::bad_alloc();
+
+#if __linux__
+	if (huge && madvise(block, capacity, MADV_HUGEPAGE))
+		std::perror("Failed to advise huge pages");
+#endif
+
+	++allocation_count;
+	allocated_byte_count+=capacity;
+
+	return static_cast<std::uint8_t *>(block);
+}
+
+void frame_pool::release(std::uint8_t *block, std::size_t capacity)
+{
+	if (!block)
+		return;
+
+	std::lock_guard<std::mutex> l(mutex);
+
+	free_blocks.emplace_back(capacity, block);
+}
+
+void frame_pool::trim()
+{
+	std::lock_guard<std::mutex> l(mutex);
+
+	for (const auto &block : free_blocks)
+	{
+		allocated_byte_count-=block.first;
+		std::free(block.second);
+	}
+
+	free_blocks.clear();
+}
+
+pooled_block::~pooled_block()
+{
+	frame_pool::instance().release(data, capacity);
+}
+
+void pooled_block::resize(std::size_t bytes)
+{
+	if (bytes>capacity)
+	{
+		std::size_t new_capacity=0;
+		auto *new_data=frame_pool::instance().acquire(bytes, new_capacity);
+
+		// contents are not preserved, every user rewrites the whole frame after resizing
+		frame_pool::instance().release(data, capacity);
+		data=new_data;
+		capacity=new_capacity;
+	}
+
+	size=bytes;
+}
+
+void pooled_frame::resize(int width, int height, int pitch, int bpp)
+{
+	storage.resize(std::size_t(height)*pitch);
+
+	this->width=width;
+	this->height=height;
+	this->pitch=pitch;
+	this->bpp=bpp;
+	data=storage.data;
+}
+
+void pooled_frame::copy(const frame_data &other)
+{
+	resize(other.width, other.height, other.pitch, other.bpp);
+	aspect_ratio=other.aspect_ratio;
+
+	if (other.data)
+		std::memcpy(data, other.data, std::size_t(height)*pitch);
+}
+
+void pooled_frame::clear()
+{
+	if (data)
+		std::memset(data, 0, std::size_t(height)*pitch);
+}
@@ -0,0 +1,150 @@
+#ifndef frame_pool_h__
+#define frame_pool_h__
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "netvid/framebuffer.h"
+
+// Hands out cache line aligned storage for frames and keeps released blocks for reuse.
+// Nothing is ever zeroed, callers that need a cleared frame have to ask for it.
+struct frame_pool
+{
+	static const std::size_t alignment=64;
+	static const std::size_t huge_page_size=2*1024*1024;
+
+	//! blocks of at least huge_page_size are huge page aligned and advised to use transparent huge pages
+	bool huge_pages=false;
+
+	static frame_pool &instance();
+
+	//! returns a block of at least bytes, capacity receives its actual size
+	std::uint8_t *acquire(std::size_t bytes, std::size_t &capacity);
+	void release(std::uint8_t *block, std::size_t capacity);
+
+	//! returns all unused blocks to the system
+	void trim();
+
+	//! blocks obtained from the system so far, constant once every mode has been seen
+	std::uint64_t allocations() const
+	{
+		return allocation_count;
+	}
+
+	std::size_t allocated_bytes() const
+	{
+		return allocated_byte_count;
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<std::pair<std::size_t, std::uint8_t *>> free_blocks;
+	std::atomic<std::uint64_t> allocation_count{ 0 };
+	std::atomic<std::size_t> allocated_byte_count{ 0 };
+};
+
+// Storage from frame_pool that only ever grows, so resizing to a size seen before
+// neither allocates nor touches memory.
+struct pooled_block
+{
+	std::uint8_t *data=nullptr;
+	std::size_t size=0;
+	std::size_t capacity=0;
+
+	pooled_block()
+	{
+
+	}
+
+	pooled_block(pooled_block &&other)
+	{
+		swap(other);
+	}
+
+	pooled_block &operator=(pooled_block &&other)
+	{
+		swap(other);
+
+		return *this;
+	}
+
+	pooled_block(const pooled_block &)=delete;
+	pooled_block &operator=(const pooled_block &)=delete;
+
+	~pooled_block();
+
+	void resize(std::size_t bytes);
+
+	void swap(pooled_block &other)
+	{
+		std::swap(data, other.data);
+		std::swap(size, other.size);
+		std::swap(capacity, other.capacity);
+	}
+};
+
+// Drop-in for frame_data_managed backed by a pooled_block
+struct pooled_frame : public frame_data
+{
+	pooled_block storage;
+
+	pooled_frame()
+	{
+
+	}
+
+	pooled_frame(const pooled_frame &other)
+		: frame_data()
+	{
+		copy(other);
+	}
+
+	pooled_frame(pooled_frame &&other)
+		: frame_data()
+	{
+		swap(other);
+	}
+
+	pooled_frame &operator=(const pooled_frame &other)
+	{
+		if (this!=&other)
+			copy(other);
+
+		return *this;
+	}
+
+	pooled_frame &operator=(pooled_frame &&other)
+	{
+		swap(other);
+
+		return *this;
+	}
+
+	void resize(int width, int height, int pitch, int bpp);
+
+	void resize(int width, int height, int bpp)
+	{
+		resize(width, height, (width*bpp+7)/8, bpp);
+	}
+
+	void copy(const frame_data &other);
+
+	//! zeroes the frame, resize() leaves previous contents behind
+	void clear();
+
+	void swap(pooled_frame &other)
+	{
+		std::swap(static_cast<frame_data &>(*this), static_cast<frame_data &>(other));
+		storage.swap(other.storage);
+	}
+};
+
+inline void swap(pooled_frame &left, pooled_frame &right)
+{
+	left.swap(right);
+}
+
+#endif // frame_pool_h__
@@ -2,9 +2,15 @@
  * CGA downscaler
  */
 
+#include <condition_variable>
+
 #include <boost/program_options.hpp>
 #include <boost/asio/high_resolution_timer.hpp>
 
+#if __linux__
+#include <sys/resource.h>
+#endif
+
 #include "netvid/check.h"
 #include "netvid/linux_framebuffer.h"
 #include "netvid/protocol.h"
@@ -13,6 +19,8 @@
 #include "common/cga.h"
 
 #include "cga_downsample.h"
+#include "static_pipeline.h"
+#include "quality_controller.h"
 #include "bayer.h"
 #include "hsp.h"
 
@@ -73,34 +81,158 @@ std::array<int, 2> parse_vector2i(const std::string &s)
 	return ret;
 }
 
+//! options that can also be changed while running, see --control
+struct pipeline_settings
+{
+	std::string algorithm="nearest";
+	std::array<int, 2> bayer_size={ { 8, 8 } };
+	std::string threshold_map="bayer";
+	double threshold_map_aspect=1;
+	std::string nearest_lut; //!< precision, empty searches the palette
+	double local_contrast_gain=0;
+	double local_contrast_stddev=.5;
+	double black_crush_high=0;
+	double black_crush_low=0;
+
+	static po::options_description options()
+	{
+		po::options_description desc("Options that can also be sent to --control");
+
+		desc.add_options()
+			("algorithm", po::value<std::string>()->default_value("nearest"), "Downsampling algorithm (arg: nearest, bayer, temporal-error-diffusion, error-diffusion)")
+			("bayer-level", po::value<std::string>()->default_value("8"), "<n> or <rows,cols>")
+			("threshold-map", po::value<std::string>()->default_value("bayer"), "Ordered dither thresholds of bayer (arg: bayer, blue-noise)")
+			("threshold-map-aspect", po::value<double>(), "Pixel height over width the blue-noise threshold map is spaced evenly for")
+			("nearest-lut", po::value<std::string>(), "Quantize nearest and temporal-error-diffusion through a lookup table instead of searching the palette (arg: 565, 666, 888)")
+			("local-contrast-gain", po::value<double>(), "Local contrast gain")
+			("local-contrast-stddev", po::value<double>(), "Local contrast standard deviance")
+			("black-crush-high", po::value<double>(), "Level at which to start crushing black")
+			("black-crush-low", po::value<double>(), "Level to consider pure black")
+			;
+
+		return desc;
+	}
+
+	//! takes the options given in vm, defaulted ones only along with_defaults; throws on invalid values
+	void update(const po::variables_map &vm, bool with_defaults)
+	{
+		auto given=[&] (const char *name)
+		{
+			return vm.count(name)>0 && (with_defaults || !vm[name].defaulted());
+		};
+
+		if (given("algorithm"))
+		{
+			algorithm=vm["algorithm"].as<std::string>();
+
+			if (algorithm!="nearest" && algorithm!="bayer" && algorithm!="temporal-error-diffusion" && algorithm!="error-diffusion" && algorithm!="passthrough")
+				throw std::invalid_argument("invalid algorithm");
+		}
+
+		if (given("bayer-level"))
+			bayer_size=parse_vector2i(vm["bayer-level"].as<std::string>());
+
+		if (given("threshold-map"))
+		{
+			threshold_map=vm["threshold-map"].as<std::string>();
+
+			if (threshold_map!="bayer" && threshold_map!="blue-noise")
+				throw std::invalid_argument("invalid threshold map");
+		}
+
+		if (given("threshold-map-aspect"))
+			threshold_map_aspect=vm["threshold-map-aspect"].as<double>();
+
+		if (given("nearest-lut"))
+		{
+			nearest_lut=vm["nearest-lut"].as<std::string>();
+			parse_lut_precision(nearest_lut);
+		}
+
+		if (given("local-contrast-gain"))
+			local_contrast_gain=vm["local-contrast-gain"].as<double>();
+
+		if (given("local-contrast-stddev"))
+			local_contrast_stddev=vm["local-contrast-stddev"].as<double>();
+
+		if (given("black-crush-high"))
+			black_crush_high=vm["black-crush-high"].as<double>();
+
+		if (given("black-crush-low"))
+			black_crush_low=vm["black-crush-low"].as<double>();
+	}
+};
+
+struct quality_t
+{
+	std::string algorithm;
+	bool local_contrast=false;
+	float local_contrast_stddev=0;
+	int blur_interval=1;
+};
+
+//! tables built for pipeline_settings, shared by the passes built from them
+struct pipeline_state
+{
+	pipeline_settings settings;
+	bayer::map bayer_map;
+	nearest_lut_t nearest_lut;
+	std::array<int, 2> frame_size={{0, 0}}; //!< reaching the final pass, 0 before the first frame
+	bayer::threshold_tile thresholds; //!< of bayer_map, for frame_size
+	std::vector<quality_t> quality_levels; //!< from the configured quality down to the cheapest the adaptive controller may fall back to
+};
+
 int main(int argc, char **argv)
 {
 	try
 	{
 		po::options_description desc("Allowed options");
-		double local_contrast_gain=0;
-		double local_contrast_stddev=.5;
-		double black_crush_high=0;
-		double black_crush_low=0;
 		bool staggered_temporal_dithering=false;
 		bool vsync_signal=false;
+		std::size_t strip_cache_kib=0;
+		bool pipelined=false;
+		bool dynamic_pipeline=false;
+		bool no_direct_lookup=false;
+		bool fixed_point=false;
+		bool no_serpentine=false;
+		double temporal_error_weight=0;
+		bool incremental=false;
+		double adaptive_quality_hz=0;
+		worker_options workers;
+		double stats_interval=0;
 
 		desc.add_options()
 			("help", "produce help message")
 			("recv", po::value<std::string>()->required(), "<ip:port>")
 			("send", po::value<std::string>()->required(), "<ip:port>")
-			("algorithm", po::value<std::string>()->default_value("nearest"), "Downsampling algorithm (arg: nearest, bayer, temporal-error-diffusion)")
-			("bayer-level", po::value<std::string>()->default_value("8"), "<n> or <rows,cols>")
+			("lut-cache", po::value<std::string>(), "Directory in which to keep built dither tables between runs")
+			("no-serpentine", po::bool_switch(&no_serpentine), "Run every row of error-diffusion left to right")
+			("temporal-error-weight", po::value<double>(&temporal_error_weight), "Share of the error error-diffusion holds back for the same pixel of the next frame")
+			("error-noise", po::value<std::string>()->default_value("white"), "Source of the random share of the error temporal-error-diffusion feeds back (arg: white, blue)")
 			("temporal-dithering", po::value<std::string>(), "Uses flickering to produce more colors (arg: client, server)")
 			("staggered-temporal-dithering", po::bool_switch(&staggered_temporal_dithering)->default_value(false), "Stagger temporal dithering")
-			("local-contrast-gain", po::value<double>(&local_contrast_gain), "Local contrast gain")
-			("local-contrast-stddev", po::value<double>(&local_contrast_stddev), "Local contrast standard deviance")
-			("black-crush-high", po::value<double>(&black_crush_high), "Level at which to start crushing black")
-			("black-crush-low", po::value<double>(&black_crush_low), "Level to consider pure black")
 			("vsync-signal", po::bool_switch(&vsync_signal), "Listen to client VSYNC signal")
 			("scale", po::value<std::string>()->default_value("1"), "Nearest neighbor pixel scaling (arg: <x,y>). Does not modify AR. Useful for 320x200->640x200 scaling to double dithering resolution")
+			("threads", po::value<int>(&workers.num_threads), "Number of processing threads (default: hardware concurrency)")
+			("cpus", po::value<std::string>(), "Pin processing threads to CPUs (arg: e.g. 0,2-3)")
+			("rt-priority", po::value<int>(&workers.rt_priority), "Run processing threads with SCHED_FIFO at this priority")
+			("mlock", po::bool_switch(&workers.lock_memory), "Lock all process memory in RAM")
+			("huge-pages", po::bool_switch(&frame_pool::instance().huge_pages), "Back large frame buffers with transparent huge pages")
+			("stats", po::value<double>(&stats_interval), "Print per-pass timing statistics every <n> seconds")
+			("dynamic-pipeline", po::bool_switch(&dynamic_pipeline), "Run every stage as a separate type-erased pass instead of one compiled pipeline per option combination")
+			("no-direct-lookup", po::bool_switch(&no_direct_lookup), "Convert the input to linear colors even when bayer or table based nearest could look up input pixels directly")
+			("fixed-point", po::bool_switch(&fixed_point), "Hand linear colors between separate passes as 16 bit fixed point instead of floats. Halves the memory of the intermediates at the cost of converting in every pass, which is slower unless memory bandwidth is the limit")
+			("adaptive-quality", po::value<double>(&adaptive_quality_hz), "Lower processing quality while frames take longer than a display period at <hz>, and restore it once there is headroom")
+			("incremental", po::bool_switch(&incremental), "Only reprocess rows that changed since the previous input frame")
+			("pipelined", po::bool_switch(&pipelined), "Process consecutive frames in overlapping pass stages, adding one frame of latency")
+			("strip-cache", po::value<std::size_t>(&strip_cache_kib), "Run all passes over horizontal strips whose working set fits in <n> KiB of cache (0 disables)")
+			("control", po::value<std::string>(), "Listen for datagrams of --option=value arguments changing the options below at <ip:port>, and switch to the rebuilt passes without pausing the output")
 			;
 
+		auto control_desc=pipeline_settings::options();
+
+		desc.add(control_desc);
+
 		po::variables_map vm;
 
 		po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -114,6 +246,9 @@ int main(int argc, char **argv)
 
 		po::notify(vm);
 
+		if (vm.count("cpus"))
+			workers.cpus=worker_options::parse_cpu_list(vm["cpus"].as<std::string>());
+
 		boost::asio::io_service local_service;
 		netvid::io_service_wrapper recv_service;
 		netvid::io_service_wrapper send_service;
@@ -127,8 +262,8 @@ int main(int argc, char **argv)
 
 		s.set_remote_endpoint(vm["send"].as<std::string>());
 
-		frame_data_managed downscaled;
-		frame_data_managed transmit_buffer;
+		pooled_frame downscaled;
+		pooled_frame transmit_buffer;
 
 		std::vector<std::uint8_t> vsync_recv_buffer(64*1024);
 		boost::asio::ip::udp::endpoint vsync_recv_endpoint;
@@ -136,94 +271,388 @@ int main(int argc, char **argv)
 		bool frame_sent=false;
 		std::promise<void> frame_sent_promise;
 		std::future<void> frame_sent_future;
-		parallel_process pp;
+		parallel_process pp(workers);
 
-		pp.render_passes.emplace_back(linearize());
+		pp.strip_cache_bytes=strip_cache_kib*1024;
+		pp.pipelined=pipelined;
+		pp.incremental=incremental;
 
+		if (stats_interval>0)
+			pp.enable_stats();
+
+		auto scale=parse_vector2i(vm["scale"].as<std::string>());
+
+		// the cache is keyed on the id of the dither lookup, change it along with the lookup
+		auto make_dither_lut=[&] (const std::vector<std::array<float, 3>> &linear_palette, const std::string &lookup_id, const auto &dither_lookup)
 		{
-			auto scale=parse_vector2i(vm["scale"].as<std::string>());
+			if (vm.count("lut-cache"))
+				return dither_lut_t(pp, linear_palette, dither_lookup, vm["lut-cache"].as<std::string>(), lookup_id);
+			else
+				return dither_lut_t(pp, linear_palette, dither_lookup);
+		};
 
-			if (scale!=std::array<int, 2>{1,1})
-				pp.render_passes.emplace_back(nearest_scale(scale[0], scale[1]));
-		}
+		auto linear_palette=cga_palette();
+		dither_lut_t dither_lut=make_dither_lut(linear_palette, "allowed_dither", dither_pair_index(linear_palette, allowed_dither));
 
-		bayer::map bayer_map;
+		bool temporal_dithering_client=true;
+		bool temporal_dithering=vm.count("temporal-dithering")>0;
+		async_temporal_dither_output tdo;
 
+		if (temporal_dithering)
 		{
-			auto bayer_size=parse_vector2i(vm["bayer-level"].as<std::string>());
+			temporal_dithering_client=(vm["temporal-dithering"].as<std::string>()=="client");
+
+			std::tie(linear_palette, tdo.indices)=combine_palette(linear_palette);
+			tdo.staggered=staggered_temporal_dithering;
 
-			bayer_map=bayer::generate(bayer_size[0], bayer_size[1]);
+			auto combine_allowed_dither=[linear_palette] (int left, int right)
+			{
+				auto left_color=linear_palette[left];
+				auto right_color=linear_palette[right];
+				auto left_hsp=rgb_to_hsp(left_color);
+				auto right_hsp=rgb_to_hsp(right_color);
+
+				auto hue_dist=fmod(std::abs(left_hsp[0]-right_hsp[0]), 1);
+				auto has_color=left_hsp[1]>.25f && right_hsp[1]>.25f;
+				auto value_dist=std::abs(left_hsp[2]-right_hsp[2]);
+
+				return (hue_dist<.25f || !has_color) && value_dist<.15f;
+			};
+
+			dither_lut=make_dither_lut(linear_palette, "combine_allowed_dither/hue.25/saturation.25/value.15", dither_pair_index(linear_palette, combine_allowed_dither));
 		}
 
-		auto linear_palette=cga_palette();
-		dither_lut_t dither_lut(linear_palette, [linear_palette] (const std::array<float, 3> &target_color)
+		error_noise noise;
+
+		if (vm["error-noise"].as<std::string>()=="blue")
+			noise=error_noise::blue();
+		else if (vm["error-noise"].as<std::string>()!="white")
+			throw std::invalid_argument("invalid error noise");
+
+		// tables whose settings did not change are taken over from previous; input_size is that of
+		// the frames going into the passes, so that the first one doesn't have to prepare for them
+		auto make_state=[&] (const pipeline_settings &settings, const pipeline_state *previous, parallel_process &builder, const std::array<int, 2> &input_size)
 		{
-			return eval_nearest_dithered_color(linear_palette, allowed_dither, target_color);
-		});
+			pipeline_state state;
+			const bool same_bayer_map=previous && previous->settings.threshold_map==settings.threshold_map && previous->settings.bayer_size==settings.bayer_size &&
+				previous->settings.threshold_map_aspect==settings.threshold_map_aspect;
+
+			state.settings=settings;
+			state.frame_size={ { input_size[0]*scale[0], input_size[1]*scale[1] } };
+
+			if (same_bayer_map)
+				state.bayer_map=previous->bayer_map;
+			else if (settings.threshold_map=="bayer")
+				state.bayer_map=bayer::generate(settings.bayer_size[0], settings.bayer_size[1]);
+			else if (settings.threshold_map=="blue-noise")
+			{
+				if (vm.count("lut-cache"))
+					state.bayer_map=bayer::cached_blue_noise(settings.bayer_size[0], settings.bayer_size[1], settings.threshold_map_aspect, vm["lut-cache"].as<std::string>());
+				else
+					state.bayer_map=bayer::generate_blue_noise(settings.bayer_size[0], settings.bayer_size[1], settings.threshold_map_aspect);
+			}
+			else
+				throw std::invalid_argument("invalid threshold map");
 
-		if (black_crush_high>0)
-			pp.render_passes.emplace_back(black_crush(black_crush_low, black_crush_high));
+			if (same_bayer_map && previous->frame_size[0]==state.frame_size[0])
+				state.thresholds=previous->thresholds;
+			else if (state.frame_size[0]>0)
+				state.thresholds=state.bayer_map.thresholds(state.frame_size[0], packed_dithered_color::mix_levels);
 
-		if (local_contrast_gain!=0)
-			add_local_contrast(pp.render_passes, local_contrast_stddev, local_contrast_gain, 0, 0);
+			if (previous && previous->settings.nearest_lut==settings.nearest_lut)
+				state.nearest_lut=previous->nearest_lut;
+			else if (!settings.nearest_lut.empty())
+				state.nearest_lut=nearest_lut_t(builder, linear_palette, parse_lut_precision(settings.nearest_lut));
 
-		bool temporal_dithering_client=true;
-		bool temporal_dithering=vm.count("temporal-dithering")>0;
+			auto &quality_levels=state.quality_levels;
 
-		if (temporal_dithering)
-			temporal_dithering_client=(vm["temporal-dithering"].as<std::string>()=="client");
+			quality_levels.resize(1);
+			quality_levels[0].algorithm=settings.algorithm;
+			quality_levels[0].local_contrast=settings.local_contrast_gain!=0;
+			quality_levels[0].local_contrast_stddev=settings.local_contrast_stddev;
+
+			if (adaptive_quality_hz>0)
+			{
+				auto quality=quality_levels.back();
+
+				if (quality.local_contrast)
+				{
+					quality.blur_interval=2;
+					quality_levels.push_back(quality);
+
+					quality.local_contrast_stddev/=2;
+					quality_levels.push_back(quality);
+
+					quality.local_contrast=false;
+					quality.blur_interval=1;
+					quality_levels.push_back(quality);
+				}
+
+				// with the dither table and threshold tile bayer is the cheapest algorithm per pixel in
+				// bench, so the others fall back to it; bayer only falls back to nearest through the
+				// lookup table, as searching the palette costs more and can't take direct_lookup
+				if (quality.algorithm=="bayer" && !state.nearest_lut.empty())
+				{
+					quality.algorithm="nearest";
+					quality_levels.push_back(quality);
+				}
+				else if (quality.algorithm=="nearest" || quality.algorithm=="temporal-error-diffusion" || quality.algorithm=="error-diffusion")
+				{
+					quality.algorithm="bayer";
+					quality_levels.push_back(quality);
+				}
+			}
+
+			return state;
+		};
 
-		auto init_algorithm=[&] (auto output_algorithm)
+		auto init_algorithm=[&] (std::vector<parallel_process::render_pass_t> &render_passes, const pipeline_state &state, auto output_algorithm, const std::string &downsample_algorithm_str, bool static_head, bool direct)
 		{
 			typedef decltype(output_algorithm) output_algorithm_t;
 
-			auto downsample_algorithm_str=vm["algorithm"].as<std::string>();
+			const auto &settings=state.settings;
+			stage::output<output_algorithm_t> output(output_algorithm);
 
-			if (downsample_algorithm_str=="nearest")
-				pp.render_passes.emplace_back(nearest<output_algorithm_t>::create(linear_palette, output_algorithm));
+			if (direct)
+			{
+				if (downsample_algorithm_str=="bayer")
+					render_passes.emplace_back(direct_lookup<output_algorithm_t>::create(state.bayer_map, dither_lut, output_algorithm, state.thresholds));
+				else
+					render_passes.emplace_back(direct_lookup<output_algorithm_t>::create(state.nearest_lut, output_algorithm));
+
+				return;
+			}
+
+			// every combination of options instantiates its own pipeline type
+			auto add_static_pipeline=[&] (const auto &...stages)
+			{
+				if (!static_head)
+					render_passes.emplace_back(make_static_pipeline<stage::linear_source>(stages...));
+				else if (settings.black_crush_high>0)
+					render_passes.emplace_back(make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::black_crush(settings.black_crush_low, settings.black_crush_high), stages...));
+				else
+					render_passes.emplace_back(make_static_pipeline<stage::srgb_source>(stage::linearize(), stages...));
+			};
+
+			// diffuses across rows, so it always follows the dynamic linear passes
+			if (downsample_algorithm_str=="error-diffusion")
+				render_passes.emplace_back(error_diffusion<output_algorithm_t>::create(linear_palette, output_algorithm, state.nearest_lut, !no_serpentine, temporal_error_weight));
+			else if (dynamic_pipeline)
+			{
+				if (downsample_algorithm_str=="nearest")
+					render_passes.emplace_back(nearest<output_algorithm_t>::create(linear_palette, output_algorithm, state.nearest_lut));
+				else if (downsample_algorithm_str=="bayer")
+					render_passes.emplace_back(bayer_r<output_algorithm_t>::create(state.bayer_map, dither_lut, output_algorithm, state.thresholds));
+				else if (downsample_algorithm_str=="temporal-error-diffusion")
+					render_passes.emplace_back(temporal_error_diffusion<output_algorithm_t>::create(linear_palette, output_algorithm, state.nearest_lut, noise));
+				else if (downsample_algorithm_str=="passthrough")
+					render_passes.emplace_back(unlinearize(fmt_a8r8g8b8));
+				else
+					throw std::invalid_argument("invalid algorithm");
+			}
+			else if (downsample_algorithm_str=="nearest")
+				add_static_pipeline(stage::nearest(linear_palette, state.nearest_lut), output);
 			else if (downsample_algorithm_str=="bayer")
-				pp.render_passes.emplace_back(bayer_r<output_algorithm_t>::create(bayer_map, dither_lut, output_algorithm));
+				add_static_pipeline(stage::bayer_r(state.bayer_map, dither_lut, state.thresholds), output);
 			else if (downsample_algorithm_str=="temporal-error-diffusion")
-				pp.render_passes.emplace_back(temporal_error_diffusion<output_algorithm_t>::create(linear_palette, output_algorithm));
+			{
+				stage::temporal_error_diffusion ted(linear_palette, state.nearest_lut, noise);
+
+				if (state.frame_size[0]>0)
+					ted.resize(state.frame_size[0], state.frame_size[1]);
+
+				add_static_pipeline(ted, output);
+			}
 			else if (downsample_algorithm_str=="passthrough")
-				pp.render_passes.emplace_back(unlinearize(fmt_a8r8g8b8));
+				add_static_pipeline(stage::unlinearize<std::uint32_t>(fmt_a8r8g8b8));
 			else
 				throw std::invalid_argument("invalid algorithm");
 		};
 
-		if (!temporal_dithering)
-			init_algorithm(normal_output());
-		else
+		// only reads state and the options fixed at startup, so passes can be built on any thread
+		auto build_passes=[&] (const pipeline_state &state, const quality_t &quality)
 		{
-			async_temporal_dither_output tdo;
+			const auto &settings=state.settings;
+			// linearize and black crush are folded into the static pipeline of the algorithm
+			// unless a pass that isn't pointwise has to run in between
+			const bool static_head=!dynamic_pipeline && scale==std::array<int, 2>{1,1} && !quality.local_contrast && quality.algorithm!="error-diffusion";
+			// table lookups straight from the input when nothing has to happen in linear space
+			const bool direct=!no_direct_lookup && scale==std::array<int, 2>{1,1} && settings.black_crush_high<=0 && !quality.local_contrast &&
+				(quality.algorithm=="bayer" || (quality.algorithm=="nearest" && !state.nearest_lut.empty()));
+
+			const auto format=fixed_point ? linear_format::fixed16 : linear_format::float32;
+			std::vector<parallel_process::render_pass_t> render_passes;
+
+			if (!static_head && !direct)
+			{
+				render_passes.emplace_back(linearize(format));
 
-			std::tie(linear_palette, tdo.indices)=combine_palette(linear_palette);
-			tdo.staggered=staggered_temporal_dithering;
+				if (scale!=std::array<int, 2>{1,1})
+					render_passes.emplace_back(nearest_scale(scale[0], scale[1]));
 
-			auto combine_allowed_dither=[linear_palette] (int left, int right)
-			{
-				auto left_color=linear_palette[left];
-				auto right_color=linear_palette[right];
-				auto left_hsp=rgb_to_hsp(left_color);
-				auto right_hsp=rgb_to_hsp(right_color);
+				if (settings.black_crush_high>0)
+					render_passes.emplace_back(black_crush(settings.black_crush_low, settings.black_crush_high, format));
 
-				auto hue_dist=fmod(std::abs(left_hsp[0]-right_hsp[0]), 1);
-				auto has_color=left_hsp[1]>.25f && right_hsp[1]>.25f;
-				auto value_dist=std::abs(left_hsp[2]-right_hsp[2]);
+				if (quality.local_contrast)
+					add_local_contrast(render_passes, quality.local_contrast_stddev, settings.local_contrast_gain, 0, 0, quality.blur_interval, format);
+			}
 
-				return (hue_dist<.25f || !has_color) && value_dist<.15f;
-			};
+			if (!temporal_dithering)
+				init_algorithm(render_passes, state, normal_output(), quality.algorithm, static_head, direct);
+			else
+				init_algorithm(render_passes, state, tdo, quality.algorithm, static_head, direct);
+
+			return render_passes;
+		};
+
+		pipeline_settings initial_settings;
+
+		initial_settings.update(vm, true);
+
+		pipeline_state current=make_state(initial_settings, nullptr, pp, { { 0, 0 } });
+		std::unique_ptr<quality_controller> controller;
+
+		auto use_passes=[&] (std::vector<parallel_process::render_pass_t> render_passes)
+		{
+			pp.render_passes=std::move(render_passes);
+			pp.invalidate();
+		};
+
+		auto reset_controller=[&]
+		{
+			if (current.quality_levels.size()>1)
+				controller.reset(new quality_controller(1/adaptive_quality_hz, current.quality_levels.size()-1));
+			else
+				controller.reset();
+		};
+
+		use_passes(build_passes(current, current.quality_levels[0]));
+		reset_controller();
+
+		// builds handed from the build thread to the frame thread, which takes them between frames
+		std::mutex pending_mutex;
+		std::atomic<bool> pending(false);
+		pipeline_state pending_state;
+		std::vector<parallel_process::render_pass_t> pending_passes;
+
+		// settings requested over the control socket; the build thread only builds the latest
+		std::mutex build_mutex;
+		std::condition_variable build_requested;
+		pipeline_settings control_settings=initial_settings;
+		std::unique_ptr<pipeline_settings> requested_settings;
+		std::array<int, 2> input_size={ { 0, 0 } }; //!< of the frames the frame thread last processed
+		std::vector<std::uint8_t> control_recv_buffer(64*1024);
+		boost::asio::ip::udp::endpoint control_recv_endpoint;
+		std::unique_ptr<netvid::socket_wrapper> control_socket;
+		std::thread build_thread;
+
+		if (vm.count("control"))
+		{
+			control_socket.reset(new netvid::socket_wrapper(local_service));
+			control_socket->bind(vm["control"].as<std::string>());
 
-			dither_lut=dither_lut_t(linear_palette, [linear_palette, combine_allowed_dither] (const std::array<float, 3> &target_color)
+			build_thread=std::thread([&, built=current] () mutable
 			{
-				return eval_nearest_dithered_color(linear_palette, combine_allowed_dither, target_color);
+#if __linux__
+				// lowered before the builder is created so that its workers inherit the priority
+				if (setpriority(PRIO_PROCESS, 0, 19))
+					std::perror("Failed to lower priority");
+#endif
+
+				// the same threads and cpus as the frame workers, so builds don't oversubscribe
+				// them, but at normal priority and without touching the process's memory locks
+				worker_options builder_workers;
+
+				builder_workers.num_threads=workers.num_threads;
+				builder_workers.cpus=workers.cpus;
+
+				parallel_process builder(builder_workers);
+
+				for (;;)
+				{
+					pipeline_settings settings;
+					std::array<int, 2> size;
+
+					{
+						std::unique_lock<std::mutex> l(build_mutex);
+
+						build_requested.wait(l, [&] { return requested_settings!=nullptr; });
+						settings=*requested_settings;
+						size=input_size;
+						requested_settings.reset();
+					}
+
+					try
+					{
+						auto build_start=std::chrono::steady_clock::now();
+						auto state=make_state(settings, &built, builder, size);
+						auto render_passes=build_passes(state, state.quality_levels[0]);
+
+						built=state;
+
+						std::lock_guard<std::mutex> l(pending_mutex);
+
+						pending_state=std::move(state);
+						pending_passes=std::move(render_passes);
+						pending=true;
+
+						std::cout << "Rebuilt passes in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-build_start).count() << " ms" << std::endl;
+					}
+					catch (const std::exception &e)
+					{
+						std::cerr << "Failed to rebuild passes: " << e.what() << std::endl;
+					}
+				}
 			});
 
-			init_algorithm(tdo);
+			recv_from_reissuer(control_socket->socket, control_recv_endpoint, boost::asio::buffer(control_recv_buffer), [&] (const boost::system::error_code &ec, std::size_t bytes_transferred)
+			{
+				if (ec)
+					return;
+
+				try
+				{
+					po::variables_map control_vm;
+					std::string message(control_recv_buffer.begin(), control_recv_buffer.begin()+bytes_transferred);
+
+					po::store(po::command_line_parser(po::split_unix(message)).options(control_desc).run(), control_vm);
+
+					// a message with an invalid value is dropped as a whole
+					auto settings=control_settings;
+
+					settings.update(control_vm, false);
+					control_settings=settings;
+
+					std::lock_guard<std::mutex> l(build_mutex);
+
+					requested_settings.reset(new pipeline_settings(control_settings));
+					build_requested.notify_one();
+				}
+				catch (const std::exception &e)
+				{
+					std::cerr << "Invalid control message: " << e.what() << std::endl;
+				}
+			});
 		}
 
+		// switches to a finished build; called by the frame thread between frames only
+		auto take_pending=[&]
+		{
+			if (!pending.load())
+				return false;
+
+			std::lock_guard<std::mutex> l(pending_mutex);
+
+			current=std::move(pending_state);
+			use_passes(std::move(pending_passes));
+			reset_controller();
+			pending=false;
+
+			return true;
+		};
+
 		std::mutex processed_mutex;
-		frame_data_managed processed_frame;
+		pooled_frame processed_frame;
 
 		auto process_current_frame=[&]
 		{
@@ -312,8 +741,9 @@ int main(int argc, char **argv)
 
 		std::thread input_frame_processing_thread([&]
 			{
-				frame_data_managed internal_buffer;
-				frame_data_managed tmp_buffer;
+				pooled_frame internal_buffer;
+				pooled_frame tmp_buffer;
+				std::array<int, 2> reported_size={ { 0, 0 } };
 
 				for (;;)
 				{
@@ -324,9 +754,16 @@ int main(int argc, char **argv)
 					const auto &in_buffer=fr.front_buffer;
 					auto current_hash=std::hash<frame_data>()(in_buffer);
 					static auto last_hash=~current_hash;
+					static bool pipeline_pending=false;
+					// new passes render the same input differently
+					bool frame_changed=take_pending() || current_hash!=last_hash;
 
-					if (in_buffer && current_hash!=last_hash)
+					// a pipelined pass list holds back one frame, push it out once the input settles
+					if (in_buffer && (frame_changed || pipeline_pending))
 					{
+						auto process_start=std::chrono::steady_clock::now();
+						const frame_data *process_in=&in_buffer;
+
 						if (in_buffer.width==640 && in_buffer.height==400 && std::abs(in_buffer.aspect_ratio-4/3.f)<1e-3f)
 						{
 							// dosbox annoyingly likes to render 640x200 as 640x400
@@ -336,12 +773,46 @@ int main(int argc, char **argv)
 							for (int y=0; y<200; ++y)
 								std::copy(in_buffer.data+y*2*in_buffer.pitch, in_buffer.data+(y*2+1)*in_buffer.pitch, tmp_buffer.data+y*tmp_buffer.pitch);
 
-							pp(tmp_buffer, internal_buffer);
+							process_in=&tmp_buffer;
+						}
+
+						// background builds prepare their passes for this size
+						if (process_in->width!=reported_size[0] || process_in->height!=reported_size[1])
+						{
+							reported_size={ { process_in->width, process_in->height } };
+
+							std::lock_guard<std::mutex> l(build_mutex);
+
+							input_size=reported_size;
 						}
-						else
-							pp(in_buffer, internal_buffer);
+
+						pp(*process_in, internal_buffer);
 
 						last_hash=current_hash;
+						pipeline_pending=pp.pipelined && frame_changed;
+
+						if (controller)
+						{
+							int previous_level=controller->level;
+
+							if (controller->add_frame(std::chrono::duration<double>(std::chrono::steady_clock::now()-process_start).count()))
+							{
+								std::cout << "Quality level " << previous_level << " -> " << controller->level << " (" << controller->average*1000 << " ms/frame, budget " << controller->budget*1000 << " ms)" << std::endl;
+								use_passes(build_passes(current, current.quality_levels[controller->level]));
+							}
+						}
+
+						static auto last_stats_dump=std::chrono::steady_clock::now();
+
+						if (pp.stats && std::chrono::steady_clock::now()-last_stats_dump>=std::chrono::duration<double>(stats_interval))
+						{
+							pp.stats->dump(std::cout, pp.render_passes.size(), pp.num_threads());
+							pp.stats->reset();
+
+							if (controller)
+								controller->dump(std::cout);
+							last_stats_dump=std::chrono::steady_clock::now();
+						}
 					}
 
 					std::unique_lock<std::mutex> l(processed_mutex);
@@ -0,0 +1,139 @@
+#include "nearest_palette.h"
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+nearest_palette::nearest_palette(const std::vector<std::array<float, 3>> &linear_palette)
+{
+	r.reserve(linear_palette.size());
+	g.reserve(linear_palette.size());
+	b.reserve(linear_palette.size());
+
+	for (const auto &color : linear_palette)
+	{
+		r.push_back(color[0]);
+		g.push_back(color[1]);
+		b.push_back(color[2]);
+	}
+}
+
+// Each lane holds one pixel and walks the whole palette, so the lanes never have to be
+// reduced against each other and the first of equal entries wins like in the scalar search.
+
+#if defined(__AVX__)
+
+static const int lanes=8;
+
+static void find_nearest(const nearest_palette &palette, const std::array<float, 3> *c, std::uint8_t *out)
+{
+	const __m256 pr=_mm256_setr_ps(c[0][0], c[1][0], c[2][0], c[3][0], c[4][0], c[5][0], c[6][0], c[7][0]);
+	const __m256 pg=_mm256_setr_ps(c[0][1], c[1][1], c[2][1], c[3][1], c[4][1], c[5][1], c[6][1], c[7][1]);
+	const __m256 pb=_mm256_setr_ps(c[0][2], c[1][2], c[2][2], c[3][2], c[4][2], c[5][2], c[6][2], c[7][2]);
+	__m256 best_distance=_mm256_set1_ps(std::numeric_limits<float>::max());
+	__m256 best_idx=_mm256_setzero_ps();
+
+	for (int i=0; i<palette.size(); ++i)
+	{
+		__m256 dr=_mm256_sub_ps(pr, _mm256_broadcast_ss(&palette.r[i]));
+		__m256 dg=_mm256_sub_ps(pg, _mm256_broadcast_ss(&palette.g[i]));
+		__m256 db=_mm256_sub_ps(pb, _mm256_broadcast_ss(&palette.b[i]));
+		__m256 dist=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+		__m256 closer=_mm256_cmp_ps(dist, best_distance, _CMP_LT_OQ);
+
+		best_distance=_mm256_min_ps(dist, best_distance);
+		best_idx=_mm256_or_ps(_mm256_and_ps(closer, _mm256_set1_ps(float(i))), _mm256_andnot_ps(closer, best_idx));
+	}
+
+	__m128i idx=_mm_packs_epi32(_mm256_castsi256_si128(_mm256_cvttps_epi32(best_idx)), _mm256_extractf128_si256(_mm256_cvttps_epi32(best_idx), 1));
+
+	_mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(idx, idx));
+}
+
+#elif defined(__SSE2__)
+
+static const int lanes=4;
+
+static void find_nearest(const nearest_palette &palette, const std::array<float, 3> *c, std::uint8_t *out)
+{
+	const __m128 pr=_mm_setr_ps(c[0][0], c[1][0], c[2][0], c[3][0]);
+	const __m128 pg=_mm_setr_ps(c[0][1], c[1][1], c[2][1], c[3][1]);
+	const __m128 pb=_mm_setr_ps(c[0][2], c[1][2], c[2][2], c[3][2]);
+	__m128 best_distance=_mm_set1_ps(std::numeric_limits<float>::max());
+	__m128 best_idx=_mm_setzero_ps();
+
+	for (int i=0; i<palette.size(); ++i)
+	{
+		__m128 dr=_mm_sub_ps(pr, _mm_set1_ps(palette.r[i]));
+		__m128 dg=_mm_sub_ps(pg, _mm_set1_ps(palette.g[i]));
+		__m128 db=_mm_sub_ps(pb, _mm_set1_ps(palette.b[i]));
+		__m128 dist=_mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+		__m128 closer=_mm_cmplt_ps(dist, best_distance);
+
+		best_distance=_mm_min_ps(dist, best_distance);
+		best_idx=_mm_or_ps(_mm_and_ps(closer, _mm_set1_ps(float(i))), _mm_andnot_ps(closer, best_idx));
+	}
+
+	__m128i idx=_mm_cvttps_epi32(best_idx);
+
+	idx=_mm_packs_epi32(idx, idx);
+	idx=_mm_packus_epi16(idx, idx);
+
+	const int packed=_mm_cvtsi128_si32(idx);
+
+	for (int i=0; i<lanes; ++i)
+		out[i]=std::uint8_t(packed >> (8*i));
+}
+
+#elif defined(__ARM_NEON)
+
+static const int lanes=4;
+
+static void find_nearest(const nearest_palette &palette, const std::array<float, 3> *c, std::uint8_t *out)
+{
+	// de-interleaves the 4 pixels into r, g and b vectors
+	const float32x4x3_t p=vld3q_f32(c[0].data());
+	float32x4_t best_distance=vdupq_n_f32(std::numeric_limits<float>::max());
+	uint32x4_t best_idx=vdupq_n_u32(0);
+
+	for (int i=0; i<palette.size(); ++i)
+	{
+		float32x4_t dr=vsubq_f32(p.val[0], vdupq_n_f32(palette.r[i]));
+		float32x4_t dg=vsubq_f32(p.val[1], vdupq_n_f32(palette.g[i]));
+		float32x4_t db=vsubq_f32(p.val[2], vdupq_n_f32(palette.b[i]));
+		float32x4_t dist=vaddq_f32(vaddq_f32(vmulq_f32(dr, dr), vmulq_f32(dg, dg)), vmulq_f32(db, db));
+		uint32x4_t closer=vcltq_f32(dist, best_distance);
+
+		best_distance=vminq_f32(dist, best_distance);
+		best_idx=vbslq_u32(closer, vdupq_n_u32(i), best_idx);
+	}
+
+	out[0]=std::uint8_t(vgetq_lane_u32(best_idx, 0));
+	out[1]=std::uint8_t(vgetq_lane_u32(best_idx, 1));
+	out[2]=std::uint8_t(vgetq_lane_u32(best_idx, 2));
+	out[3]=std::uint8_t(vgetq_lane_u32(best_idx, 3));
+}
+
+#else
+
+static const int lanes=1;
+
+static void find_nearest(const nearest_palette &palette, const std::array<float, 3> *c, std::uint8_t *out)
+{
+	*out=palette(*c);
+}
+
+#endif
+
+void nearest_palette::operator()(const std::array<float, 3> *linear_colors, int count, std::uint8_t *out) const
+{
+	int i=0;
+
+	for (; i+lanes<=count; i+=lanes)
+		find_nearest(*this, linear_colors+i, out+i);
+
+	for (; i<count; ++i)
+		out[i]=(*this)(linear_colors[i]);
+}
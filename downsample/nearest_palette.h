@@ -0,0 +1,51 @@
+#ifndef nearest_palette_h__
+#define nearest_palette_h__
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Palette laid out as separate r, g and b arrays for searching the nearest entry of many
+// colors. Entries are compared by squared distance, which orders them like distance().
+// Ties go to the lower index, as in eval_nearest_color.
+struct nearest_palette
+{
+	std::vector<float> r;
+	std::vector<float> g;
+	std::vector<float> b;
+
+	nearest_palette(const std::vector<std::array<float, 3>> &linear_palette=std::vector<std::array<float, 3>>());
+
+	int size() const
+	{
+		return int(r.size());
+	}
+
+	std::uint8_t operator()(const std::array<float, 3> &linear_color) const
+	{
+		float best_distance=std::numeric_limits<float>::max();
+		int best_idx=0;
+
+		for (int i=0; i<size(); ++i)
+		{
+			float dr=linear_color[0]-r[i];
+			float dg=linear_color[1]-g[i];
+			float db=linear_color[2]-b[i];
+			float dist=dr*dr+dg*dg+db*db;
+
+			if (dist<best_distance)
+			{
+				best_distance=dist;
+				best_idx=i;
+			}
+		}
+
+		return std::uint8_t(best_idx);
+	}
+
+	//! nearest entry of count colors, several at a time where SIMD is available
+	void operator()(const std::array<float, 3> *linear_colors, int count, std::uint8_t *out) const;
+};
+
+#endif // nearest_palette_h__
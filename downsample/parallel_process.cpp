@@ -1,69 +1,1071 @@
 #include "parallel_process.h"
 
-parallel_process::parallel_process()
+#include <algorithm>
+#include <climits>
+#include <tuple>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <regex>
+
+#if __linux__
+#include <pthread.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	inline void cpu_relax()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	inline void futex_wait(std::atomic<int> &word, int expected)
+	{
+#if __linux__
+		syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	inline void futex_wake_all(std::atomic<int> &word)
+	{
+#if __linux__
+		syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+	}
+}
+
+spin_barrier::spin_barrier(int count/*=0*/)
+	: remaining(count), sense(0), sleepers(0), count(count)
+{
+
+}
+
+void spin_barrier::reset(int count)
+{
+	this->count=count;
+	remaining.store(count);
+	sense.store(0);
+}
+
+void spin_barrier::wait(bool &local_sense)
+{
+	local_sense=!local_sense;
+
+	const int target=local_sense ? 1 : 0;
+
+	if (remaining.fetch_sub(1, std::memory_order_acq_rel)==1)
+	{
+		remaining.store(count, std::memory_order_relaxed);
+
+		// seq_cst on both sides of the sleepers/sense handshake, so that a waiter either sees
+		// the new sense or is counted in sleepers; with acquire/release both loads may miss
+		sense.store(target, std::memory_order_seq_cst);
+
+		if (sleepers.load(std::memory_order_seq_cst)>0)
+			futex_wake_all(sense);
+
+		return;
+	}
+
+	for (int i=0; i<spin_count; ++i)
+	{
+		if (sense.load(std::memory_order_acquire)==target)
+			return;
+
+		cpu_relax();
+	}
+
+	sleepers.fetch_add(1, std::memory_order_seq_cst);
+
+	while (sense.load(std::memory_order_seq_cst)!=target)
+		futex_wait(sense, 1-target);
+
+	sleepers.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+latency_histogram::latency_histogram()
+{
+	reset();
+}
+
+void latency_histogram::add(std::uint64_t ns)
+{
+	int bucket=0;
+
+	if (ns>=(1u << sub_bits))
+	{
+		int octave=63-__builtin_clzll(ns);
+
+		bucket=((octave-sub_bits+1) << sub_bits)+int((ns >> (octave-sub_bits)) & ((1 << sub_bits)-1));
+	}
+	else
+		bucket=int(ns);
+
+	buckets[std::min(bucket, bucket_count-1)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+
+	auto current_max=max.load(std::memory_order_relaxed);
+
+	while (ns>current_max && !max.compare_exchange_weak(current_max, ns, std::memory_order_relaxed))
+		;
+}
+
+void latency_histogram::reset()
+{
+	for (auto &b : buckets)
+		b.store(0, std::memory_order_relaxed);
+
+	count.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+std::uint64_t latency_histogram::percentile(double fraction) const
+{
+	auto total=count.load(std::memory_order_relaxed);
+	auto target=std::uint64_t(fraction*total);
+	std::uint64_t seen=0;
+
+	if (total==0)
+		return 0;
+
+	for (int bucket=0; bucket<bucket_count; ++bucket)
+	{
+		seen+=buckets[bucket].load(std::memory_order_relaxed);
+
+		if (seen<=target)
+			continue;
+
+		if (bucket<(1 << sub_bits))
+			return bucket;
+
+		int octave=(bucket >> sub_bits)+sub_bits-1;
+		std::uint64_t mantissa=(1 << sub_bits)+(bucket & ((1 << sub_bits)-1));
+
+		return mantissa << (octave-sub_bits);
+	}
+
+	return max.load(std::memory_order_relaxed);
+}
+
+const int process_stats::max_passes;
+
+process_stats::process_stats()
+{
+	reset();
+
+	// calibrate ticks against the steady clock
+	auto clock_start=std::chrono::steady_clock::now();
+	auto tick_start=ticks();
+
+	while (std::chrono::steady_clock::now()-clock_start<std::chrono::milliseconds(10))
+		;
+
+	auto elapsed=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-clock_start).count();
+
+	ns_per_tick=double(elapsed)/std::max<std::uint64_t>(1, ticks()-tick_start);
+}
+
+std::uint64_t process_stats::ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	std::uint64_t v;
+
+	asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+
+	return v;
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void process_stats::reset()
+{
+	for (auto &pass : passes)
+	{
+		pass.init.reset();
+		pass.render.reset();
+		pass.wait.reset();
+	}
+
+	frame.reset();
+
+	for (auto &t : thread_busy_ns)
+		t.store(0, std::memory_order_relaxed);
+
+	for (auto &t : thread_wait_ns)
+		t.store(0, std::memory_order_relaxed);
+}
+
+void process_stats::dump(std::ostream &stream, int pass_count, int thread_count) const
+{
+	auto us=[] (std::uint64_t ns) { return ns/1000.0; };
+	auto line=[&] (const char *label, const latency_histogram &h)
+	{
+		stream << label << " n=" << h.count.load() << " p50=" << us(h.percentile(.5)) << "us p99=" << us(h.percentile(.99)) << "us max=" << us(h.max.load()) << "us";
+	};
+
+	line("frame", frame);
+	stream << std::endl;
+
+	for (int p=0; p<std::min(pass_count, max_passes); ++p)
+	{
+		const auto &pass=passes[p];
+
+		if (pass.render.count.load()==0)
+			continue;
+
+		stream << "  pass " << p << ": ";
+		line("render", pass.render);
+		stream << " | ";
+		line("wait", pass.wait);
+		stream << " | ";
+		line("init", pass.init);
+		stream << std::endl;
+	}
+
+	for (int t=0; t<std::min<int>(thread_count, thread_busy_ns.size()); ++t)
+		stream << "  thread " << t << ": busy=" << us(thread_busy_ns[t].load()) << "us wait=" << us(thread_wait_ns[t].load()) << "us" << std::endl;
+
+	const auto &pool=frame_pool::instance();
+
+	stream << "  frame_pool: allocations=" << pool.allocations() << " bytes=" << pool.allocated_bytes() << std::endl;
+}
+
+void parallel_process::enable_stats(bool enable/*=true*/)
+{
+	if (!enable)
+		stats.reset();
+	else if (!stats)
+		stats.reset(new process_stats());
+}
+
+chunk_deque::chunk_deque()
+	: range(0)
 {
-	work.emplace(io_service);
 
-	threads.reserve(std::thread::hardware_concurrency());
+}
+
+void chunk_deque::reset(int begin, int end)
+{
+	range.store((std::uint64_t(begin) << 32) | std::uint32_t(end), std::memory_order_release);
+}
+
+bool chunk_deque::pop_front(int &chunk)
+{
+	auto current=range.load(std::memory_order_acquire);
+
+	for (;;)
+	{
+		int begin=int(current >> 32);
+		int end=int(current & 0xffffffff);
+
+		if (begin>=end)
+			return false;
+
+		if (range.compare_exchange_weak(current, (std::uint64_t(begin+1) << 32) | std::uint32_t(end), std::memory_order_acq_rel))
+		{
+			chunk=begin;
+
+			return true;
+		}
+	}
+}
+
+bool chunk_deque::steal_back(int &chunk)
+{
+	auto current=range.load(std::memory_order_acquire);
+
+	for (;;)
+	{
+		int begin=int(current >> 32);
+		int end=int(current & 0xffffffff);
+
+		if (begin>=end)
+			return false;
+
+		if (range.compare_exchange_weak(current, (std::uint64_t(begin) << 32) | std::uint32_t(end-1), std::memory_order_acq_rel))
+		{
+			chunk=end-1;
+
+			return true;
+		}
+	}
+}
 
-	for (unsigned int i=0; i<std::thread::hardware_concurrency(); ++i)
-		threads.emplace_back([this] { io_service.run(); });
+std::vector<int> worker_options::parse_cpu_list(const std::string &s)
+{
+	std::regex re(R"((\d+)(-(\d+))?)", std::regex::ECMAScript);
+	std::vector<int> ret;
+
+	for (std::sregex_iterator i(s.begin(), s.end(), re), end; i!=end; ++i)
+	{
+		const auto &sm=*i;
+		int first=std::stoi(sm.str(1));
+		int last=(sm.length(3)>0) ? std::stoi(sm.str(3)) : first;
+
+		for (int cpu=first; cpu<=last; ++cpu)
+			ret.push_back(cpu);
+	}
+
+	return ret;
+}
+
+namespace
+{
+	int worker_count(const worker_options &options)
+	{
+		if (options.num_threads>0)
+			return options.num_threads;
+
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+}
+
+parallel_process::parallel_process(const worker_options &options/*=worker_options()*/)
+	: chunk_deques(worker_count(options)), options(options)
+{
+	int thread_count=worker_count(options);
+
+#if __linux__
+	if (options.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+		std::perror("Failed to lock memory");
+#endif
+
+	barrier.reset(thread_count);
+
+	// the calling thread acts as worker 0
+	threads.reserve(thread_count-1);
+
+	for (int i=1; i<thread_count; ++i)
+		threads.emplace_back([this, i] { worker(i); });
 }
 
 
 parallel_process::~parallel_process()
 {
-	work.reset();
+	stopping=true;
+	barrier.wait(caller_sense);
 
 	for (auto &t : threads)
 		t.join();
 }
 
-void parallel_process::operator()(const frame_data &in, frame_data_managed &out)
+int parallel_process::num_threads() const
 {
-	const frame_data *current_in=&in;
+	return threads.size()+1;
+}
 
-	for (auto i=render_passes.begin(); i!=render_passes.end(); ++i)
+void parallel_process::configure_thread(int thread_idx)
+{
+#if __linux__
+	if (!options.cpus.empty())
 	{
-		auto &render_pass=*i;
+		cpu_set_t cpu_set;
 
-		if (i==--render_passes.end())
-			std::swap(render_pass.frame, out);
+		CPU_ZERO(&cpu_set);
+		CPU_SET(options.cpus[thread_idx%options.cpus.size()], &cpu_set);
 
-		render_pass.init(*current_in, render_pass);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set))
+			std::perror("Failed to set affinity");
+	}
+
+	if (options.rt_priority>0)
+	{
+		sched_param sp={ options.rt_priority };
+
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+			std::perror("Failed to set priority");
+	}
+#endif
+}
+
+void parallel_process::worker(int thread_idx)
+{
+	bool sense=false;
+
+	configure_thread(thread_idx);
+
+	for (;;)
+	{
+		barrier.wait(sense);
+
+		if (stopping)
+			return;
+
+		run_steps(thread_idx, sense);
+	}
+}
+
+void parallel_process::run_steps(int thread_idx, bool &sense)
+{
+	if (active_stats)
+		run_phases<true>(thread_idx, sense);
+	else
+		run_phases<false>(thread_idx, sense);
+}
+
+template<bool timed>
+void parallel_process::run_phases(int thread_idx, bool &sense)
+{
+	render_context ctx;
+	process_stats *frame_stats=active_stats;
+	std::uint64_t render_start=0;
+	std::uint64_t render_end=0;
+
+	for (const auto &phase : phases)
+	{
+		const auto &step=steps[phase.step];
+		const int thread_end=(phase.thread_end<0) ? num_threads() : phase.thread_end;
+		const bool participating=(thread_idx>=phase.thread_begin && thread_idx<thread_end);
+
+		if (timed)
+			render_start=process_stats::ticks();
+
+		if (participating)
+		{
+			const int group_size=thread_end-phase.thread_begin;
+			const int group_idx=thread_idx-phase.thread_begin;
+
+			ctx.row_begin=phase.row_begin;
+			ctx.row_end=phase.row_end;
+
+			if (chunks_per_thread<=0 || step.last_pass->wavefront)
+			{
+				ctx.thread_idx=group_idx;
+				ctx.num_threads=group_size;
+				run_step(step, thread_idx, ctx);
+			}
+			else
+			{
+				const int rows=(phase.row_end<0) ? step.in->height : phase.row_end-phase.row_begin;
+				const int chunk_count=std::max(1, std::min(rows, group_size*chunks_per_thread));
+				int chunk;
+
+				chunk_deques[thread_idx].reset(chunk_count*group_idx/group_size, chunk_count*(group_idx+1)/group_size);
+				ctx.num_threads=chunk_count;
+
+				while (next_chunk(thread_idx, phase.thread_begin, thread_end, chunk))
+				{
+					ctx.thread_idx=chunk;
+					run_step(step, thread_idx, ctx);
+				}
+			}
+		}
+
+		if (timed)
+			render_end=process_stats::ticks();
+
+		if (phase.barrier)
+			barrier.wait(sense);
+
+		if (timed)
+		{
+			auto &pass_stats=frame_stats->passes[std::min<int>(step.first_pass-render_passes.data(), process_stats::max_passes-1)];
+			auto busy=frame_stats->to_ns(render_end-render_start);
+			auto wait=frame_stats->to_ns(process_stats::ticks()-render_end);
+
+			if (participating)
+				pass_stats.render.add(busy);
+
+			if (phase.barrier)
+				pass_stats.wait.add(wait);
+
+			if (thread_idx<int(frame_stats->thread_busy_ns.size()))
+			{
+				frame_stats->thread_busy_ns[thread_idx].fetch_add(busy, std::memory_order_relaxed);
+				frame_stats->thread_wait_ns[thread_idx].fetch_add(wait, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// keep the caller from returning while the last phase is still being recorded
+	if (timed)
+		barrier.wait(sense);
+}
+
+bool parallel_process::next_chunk(int thread_idx, int thread_begin, int thread_end, int &chunk)
+{
+	if (chunk_deques[thread_idx].pop_front(chunk))
+		return true;
+
+	const int group_size=thread_end-thread_begin;
+
+	for (int i=1; i<group_size; ++i)
+	{
+		int victim=thread_begin+(thread_idx-thread_begin+i)%group_size;
+
+		if (chunk_deques[victim].steal_back(chunk))
+			return true;
+	}
+
+	return false;
+}
+
+void parallel_process::run_step(const step_t &step, int thread_idx, const render_context &ctx)
+{
+	if (step.first_pass==step.last_pass)
+		step.first_pass->render(*step.in, step.first_pass->frame, ctx);
+	else
+		run_fused(step, thread_idx, ctx);
+}
 
-		int working_threads=threads.size();
+void parallel_process::run_fused(const step_t &step, int thread_idx, const render_context &ctx)
+{
+	const auto &in=*step.in;
+	frame_data rows[2];
+
+	// intermediates live in per-thread scratch rows; a zero pitch maps every y onto the same row
+	for (int i=0; i<2; ++i)
+	{
+		rows[i].width=in.width;
+		rows[i].height=in.height;
+		rows[i].pitch=0;
+		rows[i].aspect_ratio=in.aspect_ratio;
+		rows[i].data=row_scratch.data+(thread_idx*2+i)*row_scratch_pitch;
+	}
 
-		render_context ctx;
+	render_context row_ctx;
 
-		ctx.num_threads=working_threads;
+	row_ctx.num_threads=1;
 
-		for (int i=0; i<int(threads.size()); ++i)
+	int line_start, line_end;
+
+	std::tie(line_start, line_end)=ctx.rows(in.height);
+
+	for (int y=line_start; y<line_end; ++y)
+	{
+		const frame_data *src=&in;
+
+		row_ctx.row_begin=y;
+		row_ctx.row_end=y+1;
+
+		for (auto *render_pass=step.first_pass; render_pass<=step.last_pass; ++render_pass)
 		{
-			ctx.thread_idx=i;
+			frame_data *dst=&render_pass->frame;
 
-			io_service.post([this, &working_threads, &render_pass, current_in, ctx]
+			if (render_pass!=step.last_pass)
 			{
-				render_pass.render(*current_in, render_pass.frame, ctx);
+				dst=&rows[(render_pass-step.first_pass)%2];
+				dst->bpp=render_pass->pointwise_bpp;
+			}
+
+			render_pass->render(*src, *dst, row_ctx);
+			src=dst;
+		}
+	}
+}
+
+bool parallel_process::plan_strips(const frame_data &in)
+{
+	std::size_t row_bytes=in.pitch;
+
+	for (const auto &step : steps)
+	{
+		const auto &render_pass=*step.last_pass;
+
+		if (render_pass.no_output)
+			continue;
+
+		if (render_pass.frame.height!=in.height)
+			return false; // rows don't line up between passes, e.g. nearest_scale
+
+		row_bytes+=render_pass.frame.pitch;
+	}
+
+	const int step_count=steps.size();
+	const int strip_rows=std::max<int>(8, strip_cache_bytes/std::max<std::size_t>(1, row_bytes));
+
+	// how far past the end of a strip each step has to run for the steps after it
+	step_lookahead.resize(step_count);
+	step_done.assign(step_count, 0);
+
+	for (int k=step_count-1; k>=0; --k)
+	{
+		step_lookahead[k]=0;
+
+		if (k+1==step_count)
+			continue;
+
+		const auto &next=steps[k+1];
+
+		step_lookahead[k]=step_lookahead[k+1];
+
+		for (auto *render_pass=next.first_pass; render_pass<=next.last_pass; ++render_pass)
+			step_lookahead[k]+=render_pass->halo;
+	}
+
+	for (int strip_end=0; strip_end<in.height; )
+	{
+		strip_end=std::min(in.height, strip_end+strip_rows);
+
+		for (int k=0; k<step_count; ++k)
+		{
+			int need=std::min(in.height, strip_end+step_lookahead[k]);
+
+			if (need<=step_done[k])
+				continue;
+
+			phases.push_back({ k, step_done[k], need });
+			step_done[k]=need;
+		}
+	}
+
+	return true;
+}
+
+void parallel_process::invalidate()
+{
+	previous_valid=false;
+	pipeline_primed=false;
+}
+
+bool parallel_process::find_dirty_rows(const frame_data &in)
+{
+	const int row_bytes=(in.width*in.bpp+7)/8;
+	const int pass_count=render_passes.size();
+	const bool comparable=previous_valid && pass_count==previous_pass_count &&
+		previous_input.width==in.width && previous_input.height==in.height && previous_input.bpp==in.bpp;
+
+	dirty_rows.clear();
+	previous_pass_count=pass_count;
+	previous_valid=true;
+
+	if (!comparable)
+	{
+		previous_input.resize(in.width, in.height, row_bytes, in.bpp);
+
+		for (int y=0; y<in.height; ++y)
+			std::memcpy(previous_input.pixel<std::uint8_t>(0, y), in.pixel<std::uint8_t>(0, y), row_bytes);
+
+		return false;
+	}
+
+	for (int y=0; y<in.height; ++y)
+	{
+		const auto *row=in.pixel<std::uint8_t>(0, y);
+		auto *previous_row=previous_input.pixel<std::uint8_t>(0, y);
+
+		if (std::memcmp(row, previous_row, row_bytes)==0)
+			continue;
 
-				std::lock_guard<std::mutex> lk(mutex);
+		std::memcpy(previous_row, row, row_bytes);
+
+		if (!dirty_rows.empty() && dirty_rows.back().second==y)
+			++dirty_rows.back().second;
+		else
+			dirty_rows.emplace_back(y, y+1);
+	}
 
-				--working_threads;
+	return true;
+}
+
+bool parallel_process::plan_dirty_rows(const frame_data &in)
+{
+	if (!find_dirty_rows(in))
+		return false;
 
-				cv.notify_one();
-			});
+	for (const auto &step : steps)
+	{
+		if (!step.last_pass->no_output && step.last_pass->frame.height!=in.height)
+			return false; // rows don't line up between passes, e.g. nearest_scale
+	}
+
+	for (int k=0; k<int(steps.size()); ++k)
+	{
+		const auto &step=steps[k];
+		int halo=0;
+		bool temporal=false;
+		bool wavefront=false;
+
+		for (auto *render_pass=step.first_pass; render_pass<=step.last_pass; ++render_pass)
+		{
+			halo+=render_pass->halo;
+			temporal=temporal || render_pass->temporal;
+			wavefront=wavefront || render_pass->wavefront;
 		}
 
+		if (temporal)
+			dirty_rows.assign(1, std::make_pair(0, in.height));
+		else if (wavefront && !dirty_rows.empty())
+			dirty_rows.assign(1, std::make_pair(dirty_rows.front().first, in.height));
+		else if (halo>0)
 		{
-			std::unique_lock<std::mutex> lk(mutex);
+			// grow every range by the rows read around it and merge the ones that now overlap
+			int merged=0;
+
+			for (auto rows : dirty_rows)
+			{
+				rows.first=std::max(0, rows.first-halo);
+				rows.second=std::min(in.height, rows.second+halo);
+
+				if (merged>0 && rows.first<=dirty_rows[merged-1].second)
+					dirty_rows[merged-1].second=rows.second;
+				else
+					dirty_rows[merged++]=rows;
+			}
+
+			dirty_rows.resize(merged);
+		}
+
+		for (const auto &rows : dirty_rows)
+			phases.push_back({ k, rows.first, rows.second });
+	}
+
+	return true;
+}
+
+bool parallel_process::fusible(int pass_idx) const
+{
+	const auto &render_pass=render_passes[pass_idx];
+
+	return fuse_pointwise && render_pass.pointwise_bpp>0 && !render_pass.no_output;
+}
 
-			cv.wait(lk, [&] { return working_threads==0; });
+const frame_data *parallel_process::add_steps(int first_pass, int end_pass, const frame_data *in, pooled_frame *out, int &row_bytes)
+{
+	const frame_data *current_in=in;
+
+	for (int i=first_pass; i<end_pass; )
+	{
+		step_t step;
+		int last_pass=i;
+
+		// intermediates of a fused chain are never initialized, so they need their render function up front
+		while (last_pass+1<end_pass && fusible(last_pass) && fusible(last_pass+1) && render_passes[last_pass].render && !render_passes[last_pass].init_every_frame)
+		{
+			row_bytes=std::max(row_bytes, (current_in->width*render_passes[last_pass].pointwise_bpp+7)/8);
+			++last_pass;
 		}
 
-		if (i==--render_passes.end())
-			std::swap(render_pass.frame, out);
+		auto &render_pass=render_passes[last_pass];
+
+		if (out && last_pass+1==end_pass)
+			std::swap(render_pass.frame, *out);
+
+		std::uint64_t init_start=stats ? process_stats::ticks() : 0;
+
+		render_pass.init(*current_in, render_pass);
+
+		if (stats)
+			stats->passes[std::min(last_pass, process_stats::max_passes-1)].init.add(stats->to_ns(process_stats::ticks()-init_start));
+
+		step.first_pass=&render_passes[i];
+		step.last_pass=&render_pass;
+		step.in=current_in;
+
+		for (int p=i; p<=last_pass; ++p)
+			pass_inputs[p]=current_in;
 
 		if (!render_pass.no_output)
 			current_in=&render_pass.frame;
+
+		steps.push_back(step);
+		i=last_pass+1;
+	}
+
+	return current_in;
+}
+
+int parallel_process::choose_pipeline_split() const
+{
+	const int pass_count=render_passes.size();
+	int best=0;
+
+	if (pipeline_split>0 && pipeline_split<pass_count)
+		return pipeline_split;
+
+	auto crosses=[&] (int split)
+	{
+		for (int p=split; p<pass_count; ++p)
+		{
+			for (const auto &read : render_passes[p].reads)
+			{
+				for (int w=0; w<split; ++w)
+				{
+					const auto &writes=render_passes[w].writes;
+
+					if (std::find(writes.begin(), writes.end(), read)!=writes.end())
+						return true;
+				}
+			}
+		}
+
+		return false;
+	};
+
+	// the second stage may only depend on the frame produced by the first one
+	for (int split=1; split<pass_count; ++split)
+	{
+		if (render_passes[split-1].no_output || crosses(split))
+			continue;
+
+		if (best==0 || std::abs(2*split-pass_count)<=std::abs(2*best-pass_count))
+			best=split;
+	}
+
+	return best;
+}
+
+std::size_t parallel_process::buffer_bytes() const
+{
+	std::size_t ret=0;
+
+	for (const auto &slot : buffer_slots)
+		ret+=slot.size;
+
+	return ret;
+}
+
+void parallel_process::plan_buffers(bool allow_aliasing)
+{
+	const int pass_count=render_passes.size();
+
+	next_buffer_plan_key.clear();
+	next_buffer_plan_key.push_back(allow_aliasing);
+
+	for (int p=0; p<pass_count; ++p)
+	{
+		const auto *in=pass_inputs[p];
+		const auto &render_pass=render_passes[p];
+
+		next_buffer_plan_key.push_back(in ? in->width : -1);
+		next_buffer_plan_key.push_back(in ? in->height : -1);
+		next_buffer_plan_key.push_back(render_pass.reads.size());
+		next_buffer_plan_key.push_back(render_pass.writes.size());
+
+		// a rebuilt pass list of the same shape still brings buffers without storage
+		for (const auto *buffers : { &render_pass.reads, &render_pass.writes })
+		{
+			for (const auto &buffer : *buffers)
+			{
+				next_buffer_plan_key.push_back(reinterpret_cast<std::intptr_t>(buffer.get()));
+				next_buffer_plan_key.push_back(buffer->persistent);
+			}
+		}
+	}
+
+	if (next_buffer_plan_key==buffer_plan_key)
+		return; // same mode as last frame, keep the current layout
+
+	buffer_plan_key=next_buffer_plan_key;
+
+	struct lifetime_t
+	{
+		buffer_t *buffer;
+		int first_use;
+		int last_use;
+		std::size_t bytes;
+		int slot;
+	};
+
+	std::vector<lifetime_t> lifetimes;
+
+	auto find=[&] (buffer_t *buffer)
+	{
+		return std::find_if(lifetimes.begin(), lifetimes.end(), [&] (const lifetime_t &l) { return l.buffer==buffer; });
+	};
+
+	for (int p=0; p<pass_count; ++p)
+	{
+		const auto *in=pass_inputs[p];
+		const auto &render_pass=render_passes[p];
+
+		if (!in)
+			continue;
+
+		for (const auto &buffer : render_pass.writes)
+		{
+			if (find(buffer.get())!=lifetimes.end())
+				continue;
+
+			buffer->frame.width=in->width;
+			buffer->frame.height=in->height;
+			buffer->frame.pitch=(in->width*buffer->bpp+7)/8;
+			buffer->frame.bpp=buffer->bpp;
+			buffer->frame.aspect_ratio=in->aspect_ratio;
+			lifetimes.push_back({ buffer.get(), p, p, buffer->frame.bytes(), -1 });
+		}
+
+		for (const auto &buffer : render_pass.reads)
+		{
+			auto l=find(buffer.get());
+
+			if (l!=lifetimes.end())
+				l->last_use=std::max(l->last_use, p);
+		}
+	}
+
+	std::vector<int> slot_busy_until;
+	std::vector<std::size_t> slot_bytes;
+
+	// greedy interval assignment; lifetimes are already ordered by first use
+	for (auto &l : lifetimes)
+	{
+		if (!allow_aliasing || l.buffer->persistent)
+		{
+			l.first_use=0;
+			l.last_use=pass_count;
+		}
+
+		for (int s=0; s<int(slot_busy_until.size()); ++s)
+		{
+			if (slot_busy_until[s]<l.first_use)
+			{
+				l.slot=s;
+				break;
+			}
+		}
+
+		if (l.slot<0)
+		{
+			l.slot=slot_busy_until.size();
+			slot_busy_until.push_back(0);
+			slot_bytes.push_back(0);
+		}
+
+		slot_busy_until[l.slot]=l.last_use;
+		slot_bytes[l.slot]=std::max(slot_bytes[l.slot], l.bytes);
+	}
+
+	buffer_slots.resize(slot_bytes.size());
+
+	for (std::size_t s=0; s<slot_bytes.size(); ++s)
+		buffer_slots[s].resize(slot_bytes[s]);
+
+	for (const auto &l : lifetimes)
+		l.buffer->frame.data=buffer_slots[l.slot].data;
+}
+
+void parallel_process::run(int rows, const std::function<void(const render_context &ctx)> &job)
+{
+	render_pass_t pass(nullptr, [&] (const frame_data &, frame_data &, const render_context &ctx) { job(ctx); });
+	frame_data job_frame;
+	step_t step;
+
+	job_frame.height=rows;
+	step.first_pass=step.last_pass=&pass;
+	step.in=&job_frame;
+
+	steps.clear();
+	phases.clear();
+	steps.push_back(step);
+	phases.push_back({ 0, 0, -1 });
+	active_stats=nullptr;
+
+	barrier.wait(caller_sense);
+	run_steps(0, caller_sense);
+}
+
+void parallel_process::operator()(const frame_data &in, pooled_frame &out)
+{
+	// the calling thread doubles as worker 0
+	if (!caller_configured)
+	{
+		configure_thread(0);
+		caller_configured=true;
+	}
+
+	const std::uint64_t frame_start=stats ? process_stats::ticks() : 0;
+	const int pass_count=render_passes.size();
+	const int split=pipelined ? choose_pipeline_split() : 0;
+	bool out_swapped=false;
+	int row_bytes=0;
+
+	steps.clear();
+	phases.clear();
+	pass_inputs.assign(pass_count, nullptr);
+
+	// init only depends on the input dimensions, so all passes are set up
+	// ahead of time and the workers run the whole pass list in one go
+	if (split>0)
+	{
+		// stage one works on the new frame while stage two finishes the previous one
+		const int thread_count=num_threads();
+		const int stage_one_threads=std::max(1, thread_count/2);
+		const int stage_two_begin=(stage_one_threads<thread_count) ? stage_one_threads : 0;
+
+		add_steps(0, split, &in, nullptr, row_bytes);
+
+		const int stage_one_steps=steps.size();
+
+		if (pipeline_primed)
+		{
+			add_steps(split, pass_count, &pipeline_boundary, &out, row_bytes);
+			out_swapped=true;
+		}
+
+		const int stage_two_steps=steps.size()-stage_one_steps;
+
+		for (int r=0; r<std::max(stage_one_steps, stage_two_steps); ++r)
+		{
+			if (r<stage_one_steps)
+				phases.push_back({ r, 0, -1, 0, stage_one_threads, r>=stage_two_steps });
+
+			if (r<stage_two_steps)
+				phases.push_back({ stage_one_steps+r, 0, -1, stage_two_begin, thread_count, true });
+		}
+	}
+	else
+	{
+		add_steps(0, pass_count, &in, &out, row_bytes);
+		out_swapped=pass_count>0;
+
+		const bool planned=(incremental && plan_dirty_rows(in)) || (strip_cache_bytes>0 && plan_strips(in));
+
+		if (!planned)
+		{
+			phases.clear();
+
+			for (int k=0; k<int(steps.size()); ++k)
+				phases.push_back({ k, 0, -1 });
+		}
+	}
+
+	if (row_bytes>row_scratch_pitch)
+	{
+		row_scratch_pitch=(row_bytes+63)/64*64;
+		row_scratch.resize(std::size_t(row_scratch_pitch)*2*num_threads());
 	}
+
+	if (!incremental || split>0)
+		previous_valid=false;
+
+	// interleaved passes (strips, pipeline stages) keep all their buffers alive at once,
+	// incremental frames need every buffer to still hold the previous frame
+	plan_buffers(!incremental && split==0 && int(phases.size())==int(steps.size()));
+
+	active_stats=stats.get();
+
+	// every phase ends on a barrier that keeps the workers from reading phases or stopping
+	// after this returns; without any phase there would be none, so leave the workers parked
+	if (!phases.empty())
+	{
+		barrier.wait(caller_sense);
+		run_steps(0, caller_sense);
+	}
+
+	if (out_swapped)
+		std::swap(render_passes.back().frame, out);
+
+	if (split>0)
+	{
+		std::swap(render_passes[split-1].frame, pipeline_boundary);
+		pipeline_primed=true;
+	}
+
+	if (stats)
+		stats->frame.add(stats->to_ns(process_stats::ticks()-frame_start));
 }
@@ -2,31 +2,150 @@
 #define parallel_process_h__
 
 #include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
+#include <array>
+#include <ostream>
 #include <functional>
-
-#include <boost/asio/io_service.hpp>
-#include <boost/optional.hpp>
+#include <memory>
+#include <vector>
+#include <string>
 
 #include "netvid/framebuffer.h"
 
+#include "frame_pool.h"
+
 struct render_context
 {
 	int thread_idx=0;
 	int num_threads=0;
+	int row_begin=0;
+	int row_end=-1; //!< when set, rows() splits [row_begin, row_end) instead of the whole frame
 
 	inline std::pair<int, int> rows(int height) const
 	{
-		int begin_row=(height*thread_idx)/num_threads;
-		int end_row=(height*(thread_idx+1))/num_threads;
+		int first=(row_end<0) ? 0 : row_begin;
+		int count=((row_end<0) ? height : row_end)-first;
+		int begin_row=first+(count*thread_idx)/num_threads;
+		int end_row=first+(count*(thread_idx+1))/num_threads;
 
 		return std::make_pair(begin_row, end_row);
 	};
 };
 
+// Sense-reversing barrier. Waiters spin for a bounded number of iterations
+// before falling back to sleeping on a futex (yielding on other platforms).
+struct spin_barrier
+{
+	static const int spin_count=4096;
+
+	std::atomic<int> remaining;
+	std::atomic<int> sense;
+	std::atomic<int> sleepers;
+	int count=0;
+
+	spin_barrier(int count=0);
+
+	void reset(int count);
+
+	//! local_sense is owned by the calling thread and flipped on every wait
+	void wait(bool &local_sense);
+};
+
+// Contiguous range of chunk indices. The owning thread takes chunks from the
+// front while other threads steal from the back; both ends share one atomic word.
+struct chunk_deque
+{
+	std::atomic<std::uint64_t> range;
+	char padding[64-sizeof(std::atomic<std::uint64_t>)];
+
+	chunk_deque();
+
+	void reset(int begin, int end);
+	bool pop_front(int &chunk);
+	bool steal_back(int &chunk);
+};
+
+// Lock-free log-linear histogram of durations in nanoseconds, 4 buckets per octave
+struct latency_histogram
+{
+	static const int sub_bits=2;
+	static const int bucket_count=40 << sub_bits;
+
+	std::array<std::atomic<std::uint32_t>, bucket_count> buckets;
+	std::atomic<std::uint64_t> count;
+	std::atomic<std::uint64_t> max;
+
+	latency_histogram();
+
+	void add(std::uint64_t ns);
+	void reset();
+
+	//! lower bound of the bucket holding the given fraction of samples, e.g. .99
+	std::uint64_t percentile(double fraction) const;
+};
+
+struct process_stats
+{
+	static const int max_passes=32;
+
+	struct pass_t
+	{
+		latency_histogram init;
+		latency_histogram render; //!< one sample per thread and phase
+		latency_histogram wait; //!< barrier wait following each render sample
+	};
+
+	std::array<pass_t, max_passes> passes;
+	latency_histogram frame;
+	std::array<std::atomic<std::uint64_t>, 64> thread_busy_ns;
+	std::array<std::atomic<std::uint64_t>, 64> thread_wait_ns;
+	double ns_per_tick=1;
+
+	process_stats();
+
+	//! cheap monotonic timestamp, see ns_per_tick
+	static std::uint64_t ticks();
+
+	std::uint64_t to_ns(std::uint64_t ticks) const
+	{
+		return std::uint64_t(ticks*ns_per_tick);
+	}
+
+	void reset();
+	void dump(std::ostream &stream, int pass_count, int thread_count) const;
+};
+
+struct worker_options
+{
+	int num_threads=0; //!< including the thread calling parallel_process, 0 uses hardware_concurrency()
+	std::vector<int> cpus; //!< worker i is pinned to cpus[i%cpus.size()], empty leaves affinity alone
+	int rt_priority=0; //!< SCHED_FIFO priority for the workers, 0 keeps the default policy
+	bool lock_memory=false; //!< mlockall() current and future pages
+
+	//! parses e.g. "0,2-3"
+	static std::vector<int> parse_cpu_list(const std::string &s);
+};
+
 struct parallel_process
 {
+	//! Intermediate a pass hands to later passes besides its frame. Sized like the input
+	//! of the first pass writing it; storage is assigned by parallel_process before rendering.
+	struct buffer_t
+	{
+		std::string name;
+		int bpp=0;
+		bool persistent=false; //!< keeps its contents between frames, so never shares storage
+		frame_data frame;
+
+		buffer_t(const std::string &name, int bpp)
+			: name(name), bpp(bpp)
+		{
+
+		}
+	};
+
+	typedef std::shared_ptr<buffer_t> buffer_ptr;
+
 	struct render_pass_t
 	{
 		typedef std::function<void(const frame_data &in, render_pass_t &pass)> init_t;
@@ -34,27 +153,132 @@ struct parallel_process
 
 		init_t init;
 		render_t render;
-		frame_data_managed frame;
+		pooled_frame frame;
 		bool no_output=false;
+		//! Output bpp of a pass where row y only depends on row y of its input, 0 otherwise.
+		//! Consecutive pointwise passes are fused into a single row loop, in which case
+		//! only the last pass of the chain is initialized and materialized.
+		int pointwise_bpp=0;
+		//! Rows above and below y of the previous pass' output that are read when producing row y
+		int halo=0;
+		//! init has to run every frame, e.g. to size state to the input, so the pass is only
+		//! fused as the last pass of a pointwise chain
+		bool init_every_frame=false;
+		//! Output changes between frames even when the input doesn't, e.g. temporal dithering
+		bool temporal=false;
+		//! Rendered by all workers of a phase at once, with thread_idx/num_threads naming the
+		//! worker rather than a chunk, so that workers may wait on each other's progress. Rows
+		//! also depend on every row above them, e.g. spatial error diffusion.
+		bool wavefront=false;
+		std::vector<buffer_ptr> reads;
+		std::vector<buffer_ptr> writes;
 	
-		render_pass_t(render_pass_t::init_t init=nullptr, render_pass_t::render_t render=nullptr)
-			: init(init), render(render)
+		render_pass_t(render_pass_t::init_t init=nullptr, render_pass_t::render_t render=nullptr, int pointwise_bpp=0)
+			: init(init), render(render), pointwise_bpp(pointwise_bpp)
 		{
 
 		}
 	};
 
+	struct step_t
+	{
+		render_pass_t *first_pass=nullptr;
+		render_pass_t *last_pass=nullptr; //!< inclusive; first_pass!=last_pass for fused pointwise chains
+		const frame_data *in=nullptr;
+	};
+
+	struct phase_t
+	{
+		int step=0;
+		int row_begin=0;
+		int row_end=-1;
+		int thread_begin=0;
+		int thread_end=-1;
+		bool barrier=true; //!< phases sharing a barrier run concurrently on disjoint threads
+	};
+
 	std::vector<render_pass_t> render_passes;
-	boost::asio::io_service io_service;
+	std::vector<step_t> steps;
+	std::vector<const frame_data *> pass_inputs;
+	std::vector<std::intptr_t> buffer_plan_key;
+	std::vector<std::intptr_t> next_buffer_plan_key;
+	std::vector<pooled_block> buffer_slots; //!< buffers with disjoint lifetimes share a slot
+	std::vector<phase_t> phases;
+	std::vector<int> step_lookahead;
+	std::vector<int> step_done;
+	//! When non-zero, the pass list is run over horizontal strips sized so that the rows
+	//! of all pass outputs touched by a strip fit in roughly this many bytes.
+	std::size_t strip_cache_bytes=0;
+	//! Splits the pass list in two stages that work on consecutive frames concurrently.
+	//! The output of operator() then lags the input by one frame.
+	bool pipelined=false;
+	int pipeline_split=0; //!< first pass of the second stage, 0 picks one automatically
+	pooled_frame pipeline_boundary;
+	bool pipeline_primed=false;
+	pooled_block row_scratch;
+	int row_scratch_pitch=0;
+	bool fuse_pointwise=true;
+	//! Row chunks per worker for each phase. The render_context handed to a pass then
+	//! describes a chunk (thread_idx/num_threads are chunk index/count) and idle workers
+	//! steal chunks from busy ones. 0 splits rows statically between workers.
+	int chunks_per_thread=4;
+	std::vector<chunk_deque> chunk_deques;
+	//! Only re-renders rows whose input changed since the previous frame, grown by the halo of
+	//! every pass they go through. Requires out to be the frame passed on the previous call.
+	//! Steps from the first temporal pass on, and pass lists that change the frame height,
+	//! are rendered in full.
+	bool incremental=false;
+	pooled_frame previous_input;
+	int previous_pass_count=-1;
+	bool previous_valid=false;
+	std::vector<std::pair<int, int>> dirty_rows; //!< [begin, end) ranges, ascending
 	std::vector<std::thread> threads;
-	std::mutex mutex;
-	std::condition_variable cv;
-	boost::optional<boost::asio::io_service::work> work;
+	spin_barrier barrier;
+	bool caller_sense=false;
+	bool stopping=false;
 
-	parallel_process();
+	worker_options options;
+	bool caller_configured=false;
+	//! Timing collection, off unless enabled. Read it from the thread driving the
+	//! frames or between frames; the histograms themselves may be read at any time.
+	std::unique_ptr<process_stats> stats;
+	process_stats *active_stats=nullptr;
+
+	parallel_process(const worker_options &options=worker_options());
 	~parallel_process();
 
-	void operator()(const frame_data &in, frame_data_managed &out);
+	int num_threads() const;
+
+	//! bytes currently allocated for declared buffers
+	std::size_t buffer_bytes() const;
+
+	void operator()(const frame_data &in, pooled_frame &out);
+
+	//! Drops state carried over from previous frames (incremental rows, the pipelined
+	//! boundary frame), e.g. after changing render_passes
+	void invalidate();
+
+	void enable_stats(bool enable=true);
+
+	//! Runs job once on the workers, with ctx.rows(rows) covering [0, rows)
+	void run(int rows, const std::function<void(const render_context &ctx)> &job);
+
+private:
+	void configure_thread(int thread_idx);
+	void worker(int thread_idx);
+	void run_steps(int thread_idx, bool &sense);
+	template<bool timed>
+	void run_phases(int thread_idx, bool &sense);
+	void run_step(const step_t &step, int thread_idx, const render_context &ctx);
+	void run_fused(const step_t &step, int thread_idx, const render_context &ctx);
+	bool next_chunk(int thread_idx, int thread_begin, int thread_end, int &chunk);
+	bool fusible(int pass_idx) const;
+	bool plan_strips(const frame_data &in);
+	bool find_dirty_rows(const frame_data &in);
+	bool plan_dirty_rows(const frame_data &in);
+	const frame_data *add_steps(int first_pass, int end_pass, const frame_data *in, pooled_frame *out, int &row_bytes);
+	int choose_pipeline_split() const;
+	void plan_buffers(bool allow_aliasing);
 };
 
 #endif // parallel_process_h__
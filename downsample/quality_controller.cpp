@@ -0,0 +1,53 @@
+#include "quality_controller.h"
+
+quality_controller::quality_controller(double budget/*=1/60.*/, int max_level/*=0*/)
+	: budget(budget), max_level(max_level), level_frames(max_level+1)
+{
+
+}
+
+bool quality_controller::add_frame(double seconds)
+{
+	++level_frames[level];
+
+	// starts from the budget so that a single slow frame after a switch doesn't count as several
+	average=((samples==0) ? budget : average)*(1-smoothing)+seconds*smoothing;
+	++samples;
+
+	over_count=(average>budget*degrade_ratio) ? over_count+1 : 0;
+	under_count=(average<budget*restore_ratio) ? under_count+1 : 0;
+
+	int next_level=level;
+
+	if (over_count>=degrade_frames && level<max_level)
+	{
+		next_level=level+1;
+		++degrade_count;
+	}
+	else if (under_count>=restore_frames && level>0)
+	{
+		next_level=level-1;
+		++restore_count;
+	}
+
+	if (next_level==level)
+		return false;
+
+	// the average so far belongs to the previous level
+	level=next_level;
+	samples=0;
+	over_count=0;
+	under_count=0;
+
+	return true;
+}
+
+void quality_controller::dump(std::ostream &stream) const
+{
+	stream << "  quality: level=" << level << " avg=" << average*1000 << "ms budget=" << budget*1000 << "ms degraded=" << degrade_count << " restored=" << restore_count << " frames/level=";
+
+	for (std::size_t i=0; i<level_frames.size(); ++i)
+		stream << (i ? "," : "") << level_frames[i];
+
+	stream << std::endl;
+}
@@ -0,0 +1,39 @@
+#ifndef quality_controller_h__
+#define quality_controller_h__
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Picks a quality level from the time spent per frame. Level 0 is full quality, higher levels
+// are cheaper. It degrades one level once the smoothed frame time stays above the budget for a
+// few frames and restores one level after a longer stretch well below it.
+struct quality_controller
+{
+	double budget=1/60.; //!< seconds available per frame, i.e. the display period
+	int max_level=0;
+	double degrade_ratio=1; //!< degrade while above budget*degrade_ratio
+	double restore_ratio=.6; //!< restore while below budget*restore_ratio, leaving room for the dearer level
+	int degrade_frames=3;
+	int restore_frames=60;
+	double smoothing=.2; //!< weight of the newest frame in average
+
+	int level=0;
+	double average=0; //!< smoothed seconds per frame at the current level
+	int samples=0; //!< frames measured since the last switch
+	int over_count=0;
+	int under_count=0;
+
+	std::vector<std::uint64_t> level_frames;
+	std::uint64_t degrade_count=0;
+	std::uint64_t restore_count=0;
+
+	quality_controller(double budget=1/60., int max_level=0);
+
+	//! returns true when level changed
+	bool add_frame(double seconds);
+
+	void dump(std::ostream &stream) const;
+};
+
+#endif // quality_controller_h__
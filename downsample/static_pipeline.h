@@ -0,0 +1,473 @@
+#ifndef STATIC_PIPELINE_H
+#define STATIC_PIPELINE_H
+
+#include <array>
+#include <algorithm>
+#include <tuple>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+#include "cga_downsample.h"
+#include "hsp.h"
+
+// A chain of pointwise stages known at compile time, rendered as a single parallel_process
+// pass. Rows are taken in runs of up to run_size pixels: the source reads a run of the input,
+// every stage maps the run produced by the previous one and the last stage writes it, so the
+// chain is a few inlined loops over a cached run instead of a type-erased call per pass.
+//
+// Sources name the type of their values as value_type and provide
+// const value_type *run(const frame_data &in, int x, int y, int count, value_type *buffer),
+// returning nullptr for input formats they don't read. Stages provide
+// value operator()(const in_type &v, int x, int y) and init(const frame_data &in, pooled_frame &out),
+// called once per frame before rendering; a stage that can do better than a loop over its
+// operator(), like a batched palette search, also provides
+// void run(const in_type *v, int x, int y, int count, value *out). The last stage provides
+// write_row(frame_data &out, int x, int y, const in_type *v, int count) instead of operator()
+// and a static bpp for its output. Stages whose result changes between frames for the same
+// input set temporal, see render_pass_t::temporal.
+
+namespace stage
+{
+
+struct stateless
+{
+	static const bool temporal=false;
+
+	void init(const frame_data &in, pooled_frame &out)
+	{
+
+	}
+};
+
+//! sRGB colors of 16 or 32 bpp input
+struct srgb_source
+{
+	typedef std::array<float, 3> value_type;
+
+	static const value_type *run(const frame_data &in, int x, int y, int count, value_type *buffer)
+	{
+		if (in.bpp==16)
+		{
+			const auto *i=in.pixel<std::uint16_t>(x, y);
+
+			for (int j=0; j<count; ++j)
+				buffer[j]=to_float_srgb(fmt_r5g6b5, i[j]);
+		}
+		else if (in.bpp==32)
+		{
+			const auto *i=in.pixel<std::uint32_t>(x, y);
+
+			for (int j=0; j<count; ++j)
+				buffer[j]=to_float_srgb(fmt_a8r8g8b8, i[j]);
+		}
+		else
+			return nullptr;
+
+		return buffer;
+	}
+};
+
+//! linear colors produced by the dynamic passes in front of the pipeline
+struct linear_source
+{
+	typedef std::array<float, 3> value_type;
+
+	//! float frames are read in place
+	static const value_type *run(const frame_data &in, int x, int y, int count, value_type *buffer)
+	{
+		if (in.bpp!=linear_bpp(linear_format::fixed16))
+			return in.pixel<value_type>(x, y);
+
+		const auto *i=in.pixel<fixed_color>(x, y);
+
+		for (int j=0; j<count; ++j)
+			buffer[j]=load_linear(i[j]);
+
+		return buffer;
+	}
+};
+
+struct linearize : stateless
+{
+	std::array<float, 3> operator()(const std::array<float, 3> &srgb, int x, int y) const
+	{
+		return to_linear(srgb);
+	}
+};
+
+struct black_crush : stateless
+{
+	float low=0;
+	float high=0.015f;
+
+	black_crush(float low, float high)
+		: low(low), high(high)
+	{
+
+	}
+
+	std::array<float, 3> operator()(const std::array<float, 3> &linear_color, int x, int y) const
+	{
+		auto hsp=rgb_to_hsp(linear_color);
+
+		hsp[2]*=smootherstep(low, high, hsp[2]);
+
+		return hsp_to_rgb(hsp);
+	}
+};
+
+struct nearest : stateless
+{
+	nearest_palette linear_palette;
+	nearest_lut_t lut;
+
+	nearest(const std::vector<std::array<float, 3>> &linear_palette, const nearest_lut_t &lut=nearest_lut_t())
+		: linear_palette(linear_palette), lut(lut)
+	{
+
+	}
+
+	std::uint8_t operator()(const std::array<float, 3> &linear_color, int x, int y) const
+	{
+		return lut.empty() ? linear_palette(linear_color) : lut.get(linear_color);
+	}
+
+	void run(const std::array<float, 3> *linear_colors, int x, int y, int count, std::uint8_t *colors) const
+	{
+		if (lut.empty())
+			linear_palette(linear_colors, count, colors);
+		else
+			for (int i=0; i<count; ++i)
+				colors[i]=lut.get(linear_colors[i]);
+	}
+};
+
+struct bayer_r
+{
+	static const bool temporal=false;
+
+	::bayer::map bayer_map;
+	::bayer::threshold_tile thresholds;
+	dither_lut_t precomputed_dither;
+
+	//! thresholds of bayer_map built ahead for the expected width save init from building them
+	bayer_r(const ::bayer::map &bayer_map, const dither_lut_t &precomputed_dither, const ::bayer::threshold_tile &thresholds=::bayer::threshold_tile())
+		: bayer_map(bayer_map), thresholds(thresholds), precomputed_dither(precomputed_dither)
+	{
+
+	}
+
+	void init(const frame_data &in, pooled_frame &out)
+	{
+		if (thresholds.width!=in.width)
+			thresholds=bayer_map.thresholds(in.width, packed_dithered_color::mix_levels);
+	}
+
+	std::uint8_t operator()(const std::array<float, 3> &linear_color, int x, int y) const
+	{
+		const auto &entry=precomputed_dither.entry(linear_color);
+
+		return (entry.mix>=thresholds.row(y)[x]) ? entry.right_color : entry.left_color;
+	}
+
+	void run(const std::array<float, 3> *linear_colors, int x, int y, int count, std::uint8_t *colors) const
+	{
+		std::array<packed_dithered_color, 64> entries;
+
+		for (int begin=0; begin<count; begin+=int(entries.size()))
+		{
+			const int n=std::min(int(entries.size()), count-begin);
+
+			for (int i=0; i<n; ++i)
+				entries[i]=precomputed_dither.entry(linear_colors[begin+i]);
+
+			dither_row(entries.data(), thresholds.row(y)+x+begin, n, colors+begin);
+		}
+	}
+};
+
+struct temporal_error_diffusion
+{
+	static const bool temporal=true;
+
+	nearest_palette linear_palette;
+	nearest_lut_t lut;
+	error_noise noise;
+	pooled_frame error;
+	pooled_frame prev_pixel;
+	std::uint32_t frame=0;
+
+	temporal_error_diffusion(const std::vector<std::array<float, 3>> &linear_palette, const nearest_lut_t &lut=nearest_lut_t(), const error_noise &noise=error_noise())
+		: linear_palette(linear_palette), lut(lut), noise(noise)
+	{
+
+	}
+
+	void init(const frame_data &in, pooled_frame &out)
+	{
+		if (error.width!=in.width || error.height!=in.height)
+			resize(in.width, in.height);
+		else
+			++frame;
+	}
+
+	//! starts over with no error for frames of this size, ahead of the first one or in init
+	void resize(int width, int height)
+	{
+		error.resize(width, height, sizeof(std::array<float, 3>)*8);
+		prev_pixel.resize(width, height, sizeof(std::array<float, 3>)*8);
+		error.clear();
+		prev_pixel.clear();
+		frame=0;
+	}
+
+	std::uint8_t operator()(const std::array<float, 3> &linear_color, int x, int y) const
+	{
+		auto target=this->target(linear_color, x, y);
+		auto cga_idx=lut.empty() ? linear_palette(target) : lut.get(target);
+
+		feed_back(linear_color, x, y, cga_idx);
+
+		return cga_idx;
+	}
+
+	//! all targets of the run are searched at once; the error of a pixel only feeds the pixel itself
+	void run(const std::array<float, 3> *linear_colors, int x, int y, int count, std::uint8_t *colors) const
+	{
+		std::array<std::array<float, 3>, 64> targets;
+
+		for (int begin=0; begin<count; begin+=int(targets.size()))
+		{
+			const int n=std::min(int(targets.size()), count-begin);
+
+			for (int i=0; i<n; ++i)
+				targets[i]=target(linear_colors[begin+i], x+begin+i, y);
+
+			if (lut.empty())
+				linear_palette(targets.data(), n, colors+begin);
+			else
+				for (int i=0; i<n; ++i)
+					colors[begin+i]=lut.get(targets[i]);
+
+			for (int i=0; i<n; ++i)
+				feed_back(linear_colors[begin+i], x+begin+i, y, colors[begin+i]);
+		}
+	}
+
+private:
+	std::array<float, 3> target(const std::array<float, 3> &linear_color, int x, int y) const
+	{
+		return clamp(add(linear_color, *error.pixel<std::array<float, 3>>(x, y)));
+	}
+
+	void feed_back(const std::array<float, 3> &linear_color, int x, int y, std::uint8_t cga_idx) const
+	{
+		auto &linear_error=*error.pixel<std::array<float, 3>>(x, y);
+		auto &prev=*prev_pixel.pixel<std::array<float, 3>>(x, y);
+		auto current_error=sub(linear_color, cga_palette()[cga_idx]);
+
+		add_ref(linear_error, current_error);
+
+		if (prev!=linear_color)
+		{
+			for (int i=0; i<3; ++i)
+				linear_error[i]+=noise(frame, x, y, i)*current_error[i];
+
+			prev=linear_color;
+		}
+
+		clamp_ref(linear_error);
+	}
+};
+
+//! writes CGA color indices through one of the output algorithms in cga_downsample.h
+template<class output_algorithm_t>
+struct output
+{
+	static const int bpp=output_algorithm_t::bpp;
+	static const bool temporal=output_algorithm_t::temporal;
+
+	output_algorithm_t output_algorithm;
+
+	output(const output_algorithm_t &output_algorithm=output_algorithm_t())
+		: output_algorithm(output_algorithm)
+	{
+
+	}
+
+	void init(const frame_data &in, pooled_frame &out)
+	{
+		output_algorithm.new_frame(in, out);
+	}
+
+	void write_row(frame_data &out, int x, int y, const std::uint8_t *colors, int count)
+	{
+		output_algorithm.write_row(out, x, y, colors, count);
+	}
+};
+
+//! writes linear colors back as sRGB pixels
+template<class storage_type>
+struct unlinearize
+{
+	static const int bpp=sizeof(storage_type)*8;
+	static const bool temporal=false;
+
+	pixel_format<storage_type> fmt;
+
+	unlinearize(const pixel_format<storage_type> &fmt)
+		: fmt(fmt)
+	{
+
+	}
+
+	void init(const frame_data &in, pooled_frame &out)
+	{
+		out.resize(in.width, in.height, bpp);
+		out.aspect_ratio=in.aspect_ratio;
+	}
+
+	void write_row(frame_data &out, int x, int y, const std::array<float, 3> *linear_colors, int count) const
+	{
+		auto *o=out.pixel<storage_type>(x, y);
+
+		for (int i=0; i<count; ++i)
+			o[i]=from_float_srgb(fmt, to_srgb(linear_colors[i]));
+	}
+};
+
+template<class... stages_t>
+struct any_temporal : std::false_type
+{
+
+};
+
+template<class first_t, class... rest_t>
+struct any_temporal<first_t, rest_t...> : std::integral_constant<bool, first_t::temporal || any_temporal<rest_t...>::value>
+{
+
+};
+
+}
+
+template<class source_t, class... stages_t>
+struct static_pipeline
+{
+	static const std::size_t last=sizeof...(stages_t)-1;
+	static const int run_size=64;
+
+	typedef typename std::tuple_element<last, std::tuple<stages_t...>>::type output_t;
+
+	std::tuple<stages_t...> stages;
+
+	static_pipeline(const stages_t &...stages)
+		: stages(stages...)
+	{
+
+	}
+
+	void init(const frame_data &in, pooled_frame &out)
+	{
+		init(in, out, std::integral_constant<std::size_t, 0>());
+	}
+
+	void render(const frame_data &in, frame_data &out, const render_context &ctx)
+	{
+		int line_start, line_end;
+		std::array<typename source_t::value_type, run_size> buffer;
+
+		std::tie(line_start, line_end)=ctx.rows(in.height);
+
+		for (int y=line_start; y<line_end; ++y)
+		{
+			for (int x=0; x<in.width; x+=run_size)
+			{
+				const int count=std::min(int(run_size), in.width-x);
+				const auto *values=source_t::run(in, x, y, count, buffer.data());
+
+				if (!values)
+					return;
+
+				apply(out, values, x, y, count, std::integral_constant<std::size_t, 0>());
+			}
+		}
+	}
+
+	static parallel_process::render_pass_t create(const stages_t &...stages)
+	{
+		auto p=std::make_shared<static_pipeline>(stages...);
+
+		parallel_process::render_pass_t render_pass(
+			[p] (const frame_data &in, parallel_process::render_pass_t &render_pass)
+			{
+				p->init(in, render_pass.frame);
+			},
+			[p] (const frame_data &in, frame_data &out, const render_context &ctx)
+			{
+				p->render(in, out, ctx);
+			},
+			output_t::bpp);
+
+		// stages size their state in init
+		render_pass.init_every_frame=true;
+		render_pass.temporal=stage::any_temporal<stages_t...>::value;
+
+		return render_pass;
+	}
+
+private:
+	void init(const frame_data &in, pooled_frame &out, std::integral_constant<std::size_t, last+1>)
+	{
+
+	}
+
+	template<std::size_t i>
+	void init(const frame_data &in, pooled_frame &out, std::integral_constant<std::size_t, i>)
+	{
+		std::get<i>(stages).init(in, out);
+		init(in, out, std::integral_constant<std::size_t, i+1>());
+	}
+
+	//! passes the run of values through stages i up to the last one, which writes it
+	template<class value_t>
+	void apply(frame_data &out, const value_t *values, int x, int y, int count, std::integral_constant<std::size_t, last>)
+	{
+		std::get<last>(stages).write_row(out, x, y, values, count);
+	}
+
+	template<class value_t, std::size_t i>
+	void apply(frame_data &out, const value_t *values, int x, int y, int count, std::integral_constant<std::size_t, i>)
+	{
+		typedef typename std::decay<decltype(std::get<i>(stages)(*values, x, y))>::type next_t;
+
+		std::array<next_t, run_size> next;
+
+		run_stage(std::get<i>(stages), values, x, y, count, next.data(), 0);
+		apply(out, next.data(), x, y, count, std::integral_constant<std::size_t, i+1>());
+	}
+
+	//! the stage's own run if it has one, else its operator() per pixel
+	template<class stage_t, class value_t, class next_t>
+	static auto run_stage(stage_t &stage, const value_t *values, int x, int y, int count, next_t *next, int)
+		-> decltype(stage.run(values, x, y, count, next))
+	{
+		stage.run(values, x, y, count, next);
+	}
+
+	template<class stage_t, class value_t, class next_t>
+	static void run_stage(stage_t &stage, const value_t *values, int x, int y, int count, next_t *next, long)
+	{
+		for (int j=0; j<count; ++j)
+			next[j]=stage(values[j], x+j, y);
+	}
+};
+
+//! e.g. make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::nearest(palette), stage::output<normal_output>())
+template<class source_t, class... stages_t>
+parallel_process::render_pass_t make_static_pipeline(const stages_t &...stages)
+{
+	return static_pipeline<source_t, stages_t...>::create(stages...);
+}
+
+#endif /* STATIC_PIPELINE_H */
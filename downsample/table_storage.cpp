@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "frame_pool.h"
+#include "table_storage.h"
+
+table_storage::table_storage(std::size_t size)
+	: size(size)
+{
+#if __linux__
+	void *p=mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p==MAP_FAILED)
+		throw std::bad_alloc();
+
+	if (frame_pool::instance().huge_pages && size>=frame_pool::huge_page_size && madvise(p, size, MADV_HUGEPAGE))
+		std::perror("Failed to advise huge pages");
+
+	data=static_cast<std::uint8_t *>(p);
+#else
+	data=static_cast<std::uint8_t *>(std::calloc(size, 1));
+
+	if (!data)
+		throw std::bad_alloc();
+#endif
+}
+
+table_storage::table_storage(const std::string &path)
+{
+#if __linux__
+	int fd=open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd<0)
+		return;
+
+	struct stat st;
+
+	if (fstat(fd, &st)==0 && st.st_size>0)
+	{
+		void *p=mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (p!=MAP_FAILED)
+		{
+			data=static_cast<std::uint8_t *>(p);
+			size=st.st_size;
+		}
+		else
+			std::perror("Failed to map table");
+	}
+
+	close(fd);
+#else
+	auto *f=std::fopen(path.c_str(), "rb");
+
+	if (!f)
+		return;
+
+	if (std::fseek(f, 0, SEEK_END)==0)
+	{
+		long file_size=std::ftell(f);
+
+		if (file_size>0)
+		{
+			data=static_cast<std::uint8_t *>(std::malloc(file_size));
+			std::rewind(f);
+
+			if (data && std::fread(data, 1, file_size, f)==std::size_t(file_size))
+				size=file_size;
+			else
+			{
+				std::free(data);
+				data=nullptr;
+			}
+		}
+	}
+
+	std::fclose(f);
+#endif
+}
+
+table_storage::~table_storage()
+{
+#if __linux__
+	if (data)
+		munmap(data, size);
+#else
+	std::free(data);
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef table_storage_h__
+#define table_storage_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Memory of large lookup tables. It is mapped rather than taken from the heap so that big
+// tables can sit on huge pages and are handed back to the system as soon as they're dropped,
+// and so that a table saved to a file can be used in place without reading it.
+struct table_storage
+{
+	std::uint8_t *data=nullptr;
+	std::size_t size=0;
+
+	//! zeroed storage of size bytes
+	explicit table_storage(std::size_t size);
+	//! read-only contents of the file at path, data stays null if it can't be mapped
+	explicit table_storage(const std::string &path);
+	~table_storage();
+
+	table_storage(const table_storage &)=delete;
+	table_storage &operator=(const table_storage &)=delete;
+};
+
+#endif // table_storage_h__
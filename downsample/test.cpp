@@ -3,13 +3,54 @@
 #include <boost/test/data/test_case.hpp>
 #include <boost/test/data/monomorphic.hpp>
 
+#include <fstream>
+#include <set>
+
+#include <unistd.h>
+
 #include "netvid/framebuffer.h"
 
 #include "cga_downsample.h"
+#include "static_pipeline.h"
+#include "quality_controller.h"
 #include "bayer.h"
 
 namespace bdata=boost::unit_test::data;
 
+// counts every heap allocation made by the test binary
+static std::atomic<std::uint64_t> heap_allocation_count(0);
+
+// Once these are inlined GCC sees free() called on what operator new returned and warns
+// at every delete, although the replacements pair malloc with free themselves.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__>=11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size)
+{
+	++heap_allocation_count;
+
+	if (void *p=std::malloc(size ? size : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__>=11
+#pragma GCC diagnostic pop
+#endif
+
 #define BOOST_TEST_INFO_VAR(var) \
 	BOOST_TEST_INFO("With parameter " #var " = " << (var))
 
@@ -287,4 +328,1110 @@ BOOST_AUTO_TEST_CASE(temporal_dither)
 	});
 
 	//auto b=dither_lut.get(s({ 0, 0, 0 }));
-}
\ No newline at end of file
+}
+
+static worker_options test_workers()
+{
+	worker_options options;
+
+	options.num_threads=4; // exercise the worker handoff regardless of the host
+
+	return options;
+}
+
+static std::vector<parallel_process::render_pass_t> counting_passes()
+{
+	std::vector<parallel_process::render_pass_t> passes;
+
+	auto pass=[] (int add)
+	{
+		return parallel_process::render_pass_t(
+			[] (const frame_data &in, parallel_process::render_pass_t &render_pass)
+			{
+				render_pass.frame.resize(in.width, in.height, 8);
+			},
+			[add] (const frame_data &in, frame_data &out, const render_context &ctx)
+			{
+				int line_start, line_end;
+
+				std::tie(line_start, line_end)=ctx.rows(in.height);
+
+				for (int y=line_start; y<line_end; ++y)
+				{
+					for (int x=0; x<in.width; ++x)
+						*out.pixel<std::uint8_t>(x, y)=*in.pixel<std::uint8_t>(x, y)+add;
+				}
+			});
+	};
+
+	passes.emplace_back(pass(1));
+	passes.emplace_back(pass(2));
+	passes.emplace_back(pass(3));
+
+	return passes;
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_passes)
+{
+	pooled_frame in;
+	pooled_frame out;
+	parallel_process pp(test_workers());
+
+	in.resize(37, 23, 8);
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; ++x)
+			*in.pixel<std::uint8_t>(x, y)=std::uint8_t(x+y);
+	}
+
+	pp.render_passes=counting_passes();
+
+	for (int frame=0; frame<3; ++frame)
+	{
+		pp(in, out);
+
+		BOOST_TEST_INFO_VAR(frame);
+		BOOST_REQUIRE(out.width==in.width);
+		BOOST_REQUIRE(out.height==in.height);
+
+		for (int y=0; y<in.height; ++y)
+		{
+			for (int x=0; x<in.width; ++x)
+				BOOST_TEST(*out.pixel<std::uint8_t>(x, y)==std::uint8_t(x+y+6));
+		}
+	}
+}
+
+static pooled_frame test_input_frame(int width, int height)
+{
+	pooled_frame in;
+
+	in.resize(width, height, 16);
+	in.aspect_ratio=4/3.f;
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; ++x)
+			*in.pixel<std::uint16_t>(x, y)=std::uint16_t((x*2654435761u+y*40503u) >> 7);
+	}
+
+	return in;
+}
+
+static bool same_pixels(const frame_data &left, const frame_data &right)
+{
+	if (left.width!=right.width || left.height!=right.height || left.bpp!=right.bpp)
+		return false;
+
+	for (int y=0; y<left.height; ++y)
+	{
+		if (!std::equal(left.pixel<std::uint8_t>(0, y), left.pixel<std::uint8_t>(0, y)+(left.width*left.bpp+7)/8, right.pixel<std::uint8_t>(0, y)))
+			return false;
+	}
+
+	return true;
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_fused)
+{
+	auto in=test_input_frame(64, 20);
+	pooled_frame fused_out;
+	pooled_frame unfused_out;
+	parallel_process fused(test_workers());
+	parallel_process unfused(test_workers());
+
+	for (auto *pp : { &fused, &unfused })
+	{
+		pp->render_passes.emplace_back(linearize());
+		pp->render_passes.emplace_back(black_crush(0, .1f));
+		pp->render_passes.emplace_back(nearest<>::create(cga_palette()));
+	}
+
+	unfused.fuse_pointwise=false;
+
+	for (int frame=0; frame<2; ++frame)
+	{
+		fused(in, fused_out);
+		unfused(in, unfused_out);
+
+		BOOST_TEST(fused.steps.size()==1);
+		BOOST_TEST(unfused.steps.size()==3);
+		BOOST_TEST(same_pixels(fused_out, unfused_out));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_fuses_init_every_frame_passes_last)
+{
+	parallel_process pp(test_workers());
+	pooled_frame out;
+
+	pp.render_passes.emplace_back(make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::unlinearize<std::uint16_t>(fmt_r5g6b5)));
+	pp.render_passes.emplace_back(linearize());
+	pp.render_passes.emplace_back(nearest<>::create(cga_palette()));
+
+	// the static pipeline's render stays bound after the first frame, it still must not become an intermediate
+	for (int width : { 64, 64, 48 })
+	{
+		pp(test_input_frame(width, 20), out);
+
+		BOOST_TEST(pp.steps.size()==2);
+		BOOST_TEST(pp.render_passes[0].frame.width==width);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(static_pipeline_matches_passes)
+{
+	auto in=test_input_frame(64, 20);
+	pooled_frame static_out;
+	pooled_frame dynamic_out;
+	parallel_process static_pp(test_workers());
+	parallel_process dynamic_pp(test_workers());
+
+	static_pp.render_passes.emplace_back(make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::black_crush(0, .1f), stage::nearest(cga_palette()), stage::output<normal_output>()));
+	dynamic_pp.render_passes.emplace_back(linearize());
+	dynamic_pp.render_passes.emplace_back(black_crush(0, .1f));
+	dynamic_pp.render_passes.emplace_back(nearest<>::create(cga_palette()));
+	dynamic_pp.fuse_pointwise=false;
+
+	for (int frame=0; frame<2; ++frame)
+	{
+		static_pp(in, static_out);
+		dynamic_pp(in, dynamic_out);
+
+		BOOST_TEST(static_pp.steps.size()==1);
+		BOOST_TEST(same_pixels(static_out, dynamic_out));
+	}
+
+	// dynamic passes in front of a pipeline hand it linear colors
+	static_pp.render_passes.clear();
+	static_pp.render_passes.emplace_back(linearize());
+	static_pp.render_passes.emplace_back(make_static_pipeline<stage::linear_source>(stage::unlinearize<std::uint16_t>(fmt_r5g6b5)));
+	static_pp(in, static_out);
+
+	BOOST_TEST(same_pixels(static_out, in));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_strips)
+{
+	auto in=test_input_frame(48, 61);
+	pooled_frame strip_out;
+	pooled_frame frame_out;
+	parallel_process strips(test_workers());
+	parallel_process whole_frame(test_workers());
+
+	for (auto *pp : { &strips, &whole_frame })
+	{
+		pp->render_passes.emplace_back(linearize());
+		add_local_contrast(pp->render_passes, 1.5f, .25f, 0, 0);
+		pp->render_passes.emplace_back(nearest<>::create(cga_palette()));
+	}
+
+	strips.strip_cache_bytes=1; // smallest strips, maximizes halo overlap
+
+	strips(in, strip_out);
+	whole_frame(in, frame_out);
+
+	BOOST_TEST(strips.phases.size()>whole_frame.phases.size());
+	BOOST_TEST(same_pixels(strip_out, frame_out));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_pipelined)
+{
+	std::vector<pooled_frame> inputs;
+	parallel_process pipelined(test_workers());
+	parallel_process reference(test_workers());
+	pooled_frame pipelined_out;
+	pooled_frame reference_out;
+
+	for (int i=0; i<3; ++i)
+		inputs.push_back(test_input_frame(40+i, 30));
+
+	for (auto *pp : { &pipelined, &reference })
+	{
+		pp->render_passes.emplace_back(linearize());
+		add_local_contrast(pp->render_passes, 1.5f, .25f, 0, 0);
+		pp->render_passes.emplace_back(bayer_r<>::create(bayer::generate(2, 2), dither_lut_t(cga_palette(), [] (const std::array<float, 3> &target_color)
+		{
+			return eval_nearest_dithered_color(cga_palette(), allowed_dither, target_color);
+		})));
+	}
+
+	pipelined.pipelined=true;
+
+	pipelined(inputs[0], pipelined_out);
+
+	BOOST_TEST(!pipelined_out);
+
+	for (std::size_t i=1; i<inputs.size(); ++i)
+	{
+		pipelined(inputs[i], pipelined_out);
+		reference(inputs[i-1], reference_out);
+
+		BOOST_TEST_INFO_VAR(i);
+		BOOST_TEST(same_pixels(pipelined_out, reference_out));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_incremental)
+{
+	auto in=test_input_frame(48, 60);
+	pooled_frame incremental_out;
+	pooled_frame full_out;
+	parallel_process incremental(test_workers());
+	parallel_process full(test_workers());
+
+	for (auto *pp : { &incremental, &full })
+	{
+		pp->render_passes.emplace_back(linearize());
+		add_local_contrast(pp->render_passes, 1, .5f);
+		pp->render_passes.emplace_back(nearest<>::create(cga_palette()));
+	}
+
+	incremental.incremental=true;
+
+	for (int frame=0; frame<4; ++frame)
+	{
+		// a blinking cursor a few rows tall
+		for (int y=30; y<33; ++y)
+		{
+			for (int x=10; x<18; ++x)
+				*in.pixel<std::uint16_t>(x, y)^=0xffff;
+		}
+
+		incremental(in, incremental_out);
+		full(in, full_out);
+
+		BOOST_TEST_INFO_VAR(frame);
+		BOOST_TEST(same_pixels(incremental_out, full_out));
+
+		if (frame>0)
+		{
+			BOOST_TEST(incremental.dirty_rows.size()==1u);
+			BOOST_TEST(incremental.dirty_rows.front().first>0);
+			BOOST_TEST(incremental.dirty_rows.front().second<in.height);
+		}
+	}
+
+	incremental(in, incremental_out);
+
+	BOOST_TEST(incremental.phases.empty());
+	BOOST_TEST(same_pixels(incremental_out, full_out));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_chunks)
+{
+	pooled_frame in;
+	pooled_frame out;
+
+	in.resize(3, 101, 8);
+
+	for (int chunks_per_thread : { 0, 1, 4, 1000 })
+	{
+		parallel_process pp(test_workers());
+		std::vector<std::atomic<int>> visits(in.height);
+
+		pp.chunks_per_thread=chunks_per_thread;
+		pp.render_passes.emplace_back(
+			[] (const frame_data &in, parallel_process::render_pass_t &render_pass)
+			{
+				render_pass.frame.resize(in.width, in.height, 8);
+			},
+			[&] (const frame_data &in, frame_data &out, const render_context &ctx)
+			{
+				int line_start, line_end;
+
+				std::tie(line_start, line_end)=ctx.rows(in.height);
+
+				for (int y=line_start; y<line_end; ++y)
+					++visits[y];
+			});
+
+		pp(in, out);
+
+		BOOST_TEST_INFO_VAR(chunks_per_thread);
+		BOOST_TEST(std::all_of(visits.begin(), visits.end(), [] (const std::atomic<int> &v) { return v==1; }));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_buffer_plan)
+{
+	auto in=test_input_frame(32, 16);
+	pooled_frame out;
+	parallel_process aliased(test_workers());
+	parallel_process strips(test_workers());
+	const std::size_t blur_bytes=in.width*in.height*sizeof(std::array<float, 2>);
+
+	for (auto *pp : { &aliased, &strips })
+	{
+		pp->render_passes.emplace_back(linearize());
+		add_local_contrast(pp->render_passes, 1.5f, .25f, 0, 0);
+		pp->render_passes.emplace_back(nearest<>::create(cga_palette()));
+	}
+
+	strips.strip_cache_bytes=1;
+
+	aliased(in, out);
+	strips(in, out);
+
+	// lc_blur_pre is dead by the time lc_blur is written, so they share storage
+	BOOST_TEST(aliased.buffer_bytes()==2*blur_bytes);
+	BOOST_TEST(strips.buffer_bytes()==3*blur_bytes);
+
+	auto *slot=aliased.buffer_slots.front().data;
+
+	aliased(in, out);
+
+	BOOST_TEST(aliased.buffer_slots.front().data==slot);
+}
+
+BOOST_AUTO_TEST_CASE(latency_histogram_percentiles)
+{
+	latency_histogram h;
+
+	for (std::uint64_t ns=1; ns<=1000; ++ns)
+		h.add(ns*1000);
+
+	BOOST_TEST(h.count==1000u);
+	BOOST_TEST(h.max==1000000u);
+
+	// buckets are a quarter octave wide
+	BOOST_TEST(h.percentile(.5)<=500000u);
+	BOOST_TEST(h.percentile(.5)>=500000u*3/4);
+	BOOST_TEST(h.percentile(.99)<=990000u);
+	BOOST_TEST(h.percentile(.99)>=990000u*3/4);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_stats)
+{
+	pooled_frame in;
+	pooled_frame out;
+	parallel_process pp(test_workers());
+	const int frames=5;
+
+	in.resize(16, 16, 8);
+	pp.render_passes=counting_passes();
+	pp.chunks_per_thread=0;
+	pp.enable_stats();
+
+	for (int i=0; i<frames; ++i)
+		pp(in, out);
+
+	BOOST_TEST(pp.stats->frame.count==std::uint64_t(frames));
+
+	for (int p=0; p<int(pp.render_passes.size()); ++p)
+	{
+		BOOST_TEST_INFO_VAR(p);
+		BOOST_TEST(pp.stats->passes[p].init.count==std::uint64_t(frames));
+		BOOST_TEST(pp.stats->passes[p].render.count==std::uint64_t(frames*pp.num_threads()));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(parallel_process_steady_state_allocations)
+{
+	auto in=test_input_frame(64, 48);
+	pooled_frame out;
+	parallel_process pp(test_workers());
+
+	pp.render_passes.emplace_back(linearize());
+	pp.render_passes.emplace_back(black_crush(0, .1f));
+	add_local_contrast(pp.render_passes, 4, .5f);
+	pp.render_passes.emplace_back(temporal_error_diffusion<>::create(cga_palette()));
+
+	pp(in, out);
+
+	const auto pool_allocations=frame_pool::instance().allocations();
+	const std::uint64_t heap_allocations=heap_allocation_count;
+
+	for (int frame=0; frame<3; ++frame)
+		pp(in, out);
+
+	const std::uint64_t steady_heap_allocations=heap_allocation_count;
+
+	BOOST_TEST(frame_pool::instance().allocations()==pool_allocations);
+	BOOST_TEST(steady_heap_allocations==heap_allocations);
+}
+
+BOOST_AUTO_TEST_CASE(quality_controller_hysteresis)
+{
+	quality_controller controller(.01, 1);
+	int switches=0;
+
+	// a single slow frame is absorbed
+	switches+=controller.add_frame(.02);
+
+	for (int i=0; i<10; ++i)
+		switches+=controller.add_frame(.005);
+
+	BOOST_TEST(switches==0);
+
+	int frames=0;
+
+	while (!controller.add_frame(.02) && frames<100)
+		++frames;
+
+	BOOST_TEST(controller.level==1);
+	BOOST_TEST(frames>=controller.degrade_frames);
+	BOOST_TEST(frames<2*controller.degrade_frames);
+
+	// already at max_level
+	for (int i=0; i<100; ++i)
+		switches+=controller.add_frame(.02);
+
+	BOOST_TEST(switches==0);
+	BOOST_TEST(controller.level==1);
+
+	frames=0;
+
+	while (!controller.add_frame(.002) && frames<1000)
+		++frames;
+
+	BOOST_TEST(controller.level==0);
+	BOOST_TEST(frames>=controller.restore_frames);
+	BOOST_TEST(frames<controller.restore_frames+10);
+	BOOST_TEST(controller.degrade_count==1u);
+	BOOST_TEST(controller.restore_count==1u);
+}
+
+BOOST_AUTO_TEST_CASE(local_contrast_blur_interval)
+{
+	auto in=test_input_frame(40, 30);
+	pooled_frame reused_out;
+	pooled_frame full_out;
+	parallel_process reused(test_workers());
+	parallel_process full(test_workers());
+
+	reused.render_passes.emplace_back(linearize());
+	add_local_contrast(reused.render_passes, 1, .5f, 0, 0, 2);
+	reused.render_passes.emplace_back(nearest<>::create(cga_palette()));
+	full.render_passes.emplace_back(linearize());
+	add_local_contrast(full.render_passes, 1, .5f, 0, 0);
+	full.render_passes.emplace_back(nearest<>::create(cga_palette()));
+
+	for (int frame=0; frame<3; ++frame)
+	{
+		reused(in, reused_out);
+		full(in, full_out);
+
+		BOOST_TEST_INFO_VAR(frame);
+		BOOST_TEST(same_pixels(reused_out, full_out));
+	}
+
+	// the kept statistics can't share storage with the blur intermediates
+	BOOST_TEST(reused.buffer_bytes()>full.buffer_bytes());
+}
+
+BOOST_DATA_TEST_CASE(nearest_palette_matches_eval_nearest_color, bdata::make({ false, true }), combined)
+{
+	auto linear_palette=cga_palette();
+
+	if (combined)
+		std::tie(linear_palette, std::ignore)=combine_palette(linear_palette);
+
+	// palette entries themselves plus a grid over the cube, in a count that leaves a tail
+	std::vector<std::array<float, 3>> colors=linear_palette;
+
+	for (int r=0; r<=10; ++r)
+		for (int g=0; g<=10; ++g)
+			for (int b=0; b<=10; ++b)
+				colors.push_back({ { r/10.f, g/10.f, b/10.f } });
+
+	nearest_palette search(linear_palette);
+	std::vector<std::uint8_t> found(colors.size());
+
+	search(colors.data(), int(colors.size()), found.data());
+
+	for (std::size_t i=0; i<colors.size(); ++i)
+	{
+		float expected_distance=0;
+		auto expected=eval_nearest_color(linear_palette, colors[i], &expected_distance);
+
+		BOOST_TEST_INFO_VAR(colors[i]);
+		BOOST_TEST(search(colors[i])==found[i]);
+
+		// equally distant entries may be ordered differently by the rounding of distance()
+		if (found[i]!=expected)
+			BOOST_TEST(distance(colors[i], linear_palette[found[i]])==expected_distance, boost::test_tools::tolerance(1e-5f));
+	}
+}
+
+BOOST_DATA_TEST_CASE(nearest_lut_exact_on_grid, bdata::make({ "565", "666", "888" }), precision)
+{
+	parallel_process pp(test_workers());
+	auto linear_palette=cga_palette();
+	nearest_lut_t lut(pp, linear_palette, parse_lut_precision(precision));
+	const std::uint32_t size=std::uint32_t(lut.lookup->size);
+	// every grid point of the small tables, a prime stride through the 8-8-8 one
+	const std::uint32_t stride=(size>(1u << 18)) ? 251 : 1;
+	int mismatches=0;
+
+	for (std::uint32_t i=0; i<size; i+=stride)
+	{
+		auto linear_color=lut.grid_color(i);
+		float expected_distance=0;
+		auto expected=eval_nearest_color(linear_palette, linear_color, &expected_distance);
+		auto found=lut.get(linear_color);
+
+		if (lut.index(linear_color)!=i)
+			++mismatches;
+		else if (found!=expected && std::abs(distance(linear_color, linear_palette[found])-expected_distance)>1e-5f)
+			++mismatches;
+	}
+
+	BOOST_TEST(mismatches==0);
+}
+
+BOOST_AUTO_TEST_CASE(srgb_quantizer_matches_to_srgb)
+{
+	srgb_quantizer quantizer(6);
+	const int max_level=quantizer.levels()-1;
+	int mismatches=0;
+
+	for (int i=0; i<=100000; ++i)
+	{
+		float linear_value=i/100000.f;
+		float level=to_srgb(std::array<float, 3>{ linear_value, linear_value, linear_value })[0]*max_level;
+		int q=quantizer(linear_value);
+
+		// values right at a boundary may round either way
+		if (q!=int(level+.5f) && std::abs(level-std::floor(level)-.5f)>1e-3f)
+			++mismatches;
+	}
+
+	BOOST_TEST(mismatches==0);
+	BOOST_TEST(quantizer(-1)==0);
+	BOOST_TEST(quantizer(2)==max_level);
+}
+
+BOOST_AUTO_TEST_CASE(dither_lut_cache)
+{
+	char cache_dir[]="/tmp/dither_lut_test_XXXXXX";
+
+	BOOST_TEST_REQUIRE(mkdtemp(cache_dir)!=nullptr);
+
+	parallel_process pp(test_workers());
+	auto linear_palette=cga_palette();
+	std::atomic<int> lookups(0);
+	auto dither_lookup=[&] (const std::array<float, 3> &target_color)
+	{
+		++lookups;
+
+		return eval_nearest_dithered_color(linear_palette, allowed_dither, target_color);
+	};
+
+	dither_lut_t built(pp, linear_palette, dither_lookup, cache_dir, "allowed_dither");
+	auto path=built.cache_path(cache_dir, "allowed_dither");
+
+	const int build_lookups=lookups;
+
+	BOOST_TEST(build_lookups>=int(dither_lut_t::size()));
+
+	dither_lut_t loaded(pp, linear_palette, dither_lookup, cache_dir, "allowed_dither");
+
+	BOOST_TEST(lookups==build_lookups);
+	BOOST_TEST(loaded.storage!=built.storage);
+
+	int mismatches=0;
+
+	for (std::size_t i=0; i<dither_lut_t::size(); ++i)
+	{
+		const auto &l=loaded.lookup[i];
+		const auto &b=built.lookup[i];
+
+		if (l.left_color!=b.left_color || l.right_color!=b.right_color || l.mix!=b.mix)
+			++mismatches;
+	}
+
+	BOOST_TEST(mismatches==0);
+
+	// another lookup or palette gets its own file
+	BOOST_TEST(built.cache_path(cache_dir, "other")!=path);
+
+	dither_lut_t other_palette;
+
+	other_palette.linear_palette=linear_palette;
+	other_palette.linear_palette[0][0]+=.001f;
+	BOOST_TEST(other_palette.cache_path(cache_dir, "allowed_dither")!=path);
+
+	// a truncated file is rebuilt
+	truncate(path.c_str(), 100);
+	lookups=0;
+
+	dither_lut_t rebuilt(pp, linear_palette, dither_lookup, cache_dir, "allowed_dither");
+
+	BOOST_TEST(lookups==build_lookups);
+
+	std::remove(path.c_str());
+	rmdir(cache_dir);
+}
+
+BOOST_DATA_TEST_CASE(dither_pair_index_matches_linear_search, bdata::make({ false, true }), combined)
+{
+	auto linear_palette=cga_palette();
+	std::function<bool(int, int)> allowed=allowed_dither;
+
+	if (combined)
+	{
+		std::tie(linear_palette, std::ignore)=combine_palette(linear_palette);
+		allowed=[&] (int left, int right)
+		{
+			return distance(linear_palette[left], linear_palette[right])<.25f;
+		};
+	}
+
+	dither_pair_index index(linear_palette, allowed);
+	// the linear search over the combined palette is slow, so it only gets a sample
+	const int stride=combined ? 97 : 1;
+	int mismatches=0;
+
+	for (int c=0; c<(1 << 16); c+=stride)
+	{
+		auto linear_color=to_linear(to_float_srgb(fmt_r5g6b5, c));
+		float expected_distance=0;
+		float found_distance=0;
+		auto expected=eval_nearest_dithered_color(linear_palette, allowed, linear_color, &expected_distance);
+		auto found=index(linear_color, &found_distance);
+
+		if (found.left_color!=expected.left_color || found.right_color!=expected.right_color ||
+			std::memcmp(&found.mix, &expected.mix, sizeof(float)) || std::memcmp(&found_distance, &expected_distance, sizeof(float)))
+			++mismatches;
+	}
+
+	BOOST_TEST(mismatches==0);
+}
+
+BOOST_AUTO_TEST_CASE(dither_lut_packed_mix)
+{
+	parallel_process pp(test_workers());
+	auto linear_palette=cga_palette();
+	dither_pair_index index(linear_palette, allowed_dither);
+	dither_lut_t dither_lut(pp, linear_palette, index);
+	int mismatches=0;
+
+	std::vector<std::uint32_t> palette_cells;
+
+	BOOST_TEST(sizeof(packed_dithered_color)==4u);
+
+	for (const auto &color : linear_palette)
+	{
+		auto cga=dither_lut.get(color);
+
+		BOOST_TEST(cga.left_color==cga.right_color);
+		palette_cells.push_back(dither_lut.index(color));
+	}
+
+	for (int c=0; c<(1 << 16); c+=7)
+	{
+		auto linear_color=to_linear(to_float_srgb(dither_lut_t::pixel_fmt(), c));
+		auto expected=index(linear_color);
+
+		// cells holding a palette color keep that color rather than the one at their center
+		if (std::find(palette_cells.begin(), palette_cells.end(), std::uint32_t(c))!=palette_cells.end())
+			continue;
+
+		auto found=dither_lut.get(linear_color);
+
+		BOOST_TEST_INFO_VAR_HEX(c);
+		BOOST_TEST(dither_lut.index(linear_color)==std::uint32_t(c));
+
+		if (found.left_color!=expected.left_color || found.right_color!=expected.right_color ||
+			std::abs(found.mix-expected.mix)>.5f/packed_dithered_color::mix_levels+1e-6f)
+			++mismatches;
+	}
+
+	BOOST_TEST(mismatches==0);
+}
+
+BOOST_DATA_TEST_CASE(direct_lookup_matches_linearized_passes, bdata::make({ 16, 32 }), bpp)
+{
+	auto in16=test_input_frame(62, 17);
+	pooled_frame in;
+
+	if (bpp==16)
+		in.copy(in16);
+	else
+	{
+		in.resize(in16.width, in16.height, 32);
+		in.aspect_ratio=in16.aspect_ratio;
+
+		for (int y=0; y<in.height; ++y)
+		{
+			for (int x=0; x<in.width; ++x)
+				*in.pixel<std::uint32_t>(x, y)=(std::uint32_t(*in16.pixel<std::uint16_t>(x, y))*2654435761u) >> 8;
+		}
+	}
+
+	parallel_process pp(test_workers());
+	auto linear_palette=cga_palette();
+	dither_lut_t dither_lut(pp, linear_palette, dither_pair_index(linear_palette, allowed_dither));
+	nearest_lut_t nearest_lut(pp, linear_palette, lut_precision::r6g6b6);
+	auto bayer_map=bayer::generate(4, 4);
+
+	auto render=[&] (std::vector<parallel_process::render_pass_t> passes)
+	{
+		parallel_process p(test_workers());
+		pooled_frame out;
+
+		p.render_passes=std::move(passes);
+		p(in, out);
+
+		return out;
+	};
+
+	std::vector<parallel_process::render_pass_t> bayer_passes;
+	std::vector<parallel_process::render_pass_t> nearest_passes;
+
+	bayer_passes.emplace_back(linearize());
+	bayer_passes.emplace_back(bayer_r<>::create(bayer_map, dither_lut));
+	nearest_passes.emplace_back(linearize());
+	nearest_passes.emplace_back(nearest<>::create(linear_palette, normal_output(), nearest_lut));
+
+	auto bayer_out=render(std::move(bayer_passes));
+	// as built ahead by a background rebuild
+	auto thresholds=bayer_map.thresholds(in.width, packed_dithered_color::mix_levels);
+
+	BOOST_TEST(same_pixels(render({ direct_lookup<>::create(bayer_map, dither_lut) }), bayer_out));
+	BOOST_TEST(same_pixels(render({ direct_lookup<>::create(bayer_map, dither_lut, normal_output(), thresholds) }), bayer_out));
+	BOOST_TEST(same_pixels(render({ linearize(), bayer_r<>::create(bayer_map, dither_lut, normal_output(), thresholds) }), bayer_out));
+	BOOST_TEST(same_pixels(render({ direct_lookup<>::create(nearest_lut) }), render(std::move(nearest_passes))));
+}
+
+BOOST_AUTO_TEST_CASE(fixed_point_matches_float)
+{
+	auto in=test_input_frame(64, 24);
+
+	auto render=[&] (linear_format format, bool quantize)
+	{
+		parallel_process p(test_workers());
+		pooled_frame out;
+
+		p.render_passes.emplace_back(linearize(format));
+		p.render_passes.emplace_back(black_crush(0, 0.015f, format));
+		add_local_contrast(p.render_passes, 4, 0.5f, 0, 0, 1, format);
+
+		if (quantize)
+			p.render_passes.emplace_back(nearest<>::create(cga_palette()));
+		else
+			p.render_passes.emplace_back(unlinearize(fmt_a8r8g8b8));
+
+		p(in, out);
+
+		return out;
+	};
+
+	auto srgb_float=render(linear_format::float32, false);
+	auto srgb_fixed=render(linear_format::fixed16, false);
+	int max_diff=0;
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; ++x)
+		{
+			auto a=*srgb_float.pixel<std::uint32_t>(x, y);
+			auto b=*srgb_fixed.pixel<std::uint32_t>(x, y);
+
+			for (int shift=0; shift<24; shift+=8)
+				max_diff=std::max(max_diff, std::abs(int((a >> shift) & 0xff)-int((b >> shift) & 0xff)));
+		}
+	}
+
+	BOOST_TEST(max_diff<=2);
+
+	auto cga_float=render(linear_format::float32, true);
+	auto cga_fixed=render(linear_format::fixed16, true);
+	int same=0;
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; x+=2)
+			same+=(*cga_float.pixel<std::uint8_t>(x, y)==*cga_fixed.pixel<std::uint8_t>(x, y));
+	}
+
+	// only colors right at a decision boundary may end up on the other side
+	BOOST_TEST(same>=in.width/2*in.height*95/100);
+}
+
+BOOST_DATA_TEST_CASE(temporal_error_diffusion_is_deterministic, bdata::make({ false, true }), blue)
+{
+	auto noise=blue ? error_noise::blue(16) : error_noise();
+	worker_options single;
+
+	single.num_threads=1;
+
+	parallel_process reference(single);
+	parallel_process threaded(test_workers());
+	parallel_process static_pp(test_workers());
+	pooled_frame reference_out;
+	pooled_frame threaded_out;
+	pooled_frame static_out;
+
+	reference.render_passes.emplace_back(linearize());
+	reference.render_passes.emplace_back(temporal_error_diffusion<>::create(cga_palette(), normal_output(), nearest_lut_t(), noise));
+	reference.chunks_per_thread=0;
+	threaded.render_passes.emplace_back(linearize());
+	threaded.render_passes.emplace_back(temporal_error_diffusion<>::create(cga_palette(), normal_output(), nearest_lut_t(), noise));
+	static_pp.render_passes.emplace_back(make_static_pipeline<stage::srgb_source>(stage::linearize(), stage::temporal_error_diffusion(cga_palette(), nearest_lut_t(), noise), stage::output<normal_output>()));
+
+	auto in=test_input_frame(64, 20);
+
+	for (int frame=0; frame<4; ++frame)
+	{
+		// pixels only pick up noise when their color changes
+		for (int y=0; y<in.height; ++y)
+		{
+			for (int x=0; x<in.width; ++x)
+				*in.pixel<std::uint16_t>(x, y)+=std::uint16_t(x*frame+y);
+		}
+
+		reference(in, reference_out);
+		threaded(in, threaded_out);
+		static_pp(in, static_out);
+
+		BOOST_TEST(same_pixels(reference_out, threaded_out));
+		BOOST_TEST(same_pixels(reference_out, static_out));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(blue_noise_ranks)
+{
+	const int size=32;
+	auto tile=bayer::generate_blue_noise(size, size);
+	std::vector<int> sorted=tile.values;
+
+	std::sort(sorted.begin(), sorted.end());
+
+	for (int i=0; i<tile.size(); ++i)
+		BOOST_TEST(sorted[i]==i);
+
+	// any 4x4 window of the half threshold holds close to 8 set cells, unlike white noise
+	for (int y=0; y<size; ++y)
+	{
+		for (int x=0; x<size; ++x)
+		{
+			int count=0;
+
+			for (int j=0; j<4; ++j)
+			{
+				for (int i=0; i<4; ++i)
+					count+=tile.values[((y+j)%size)*size+(x+i)%size]<tile.size()/2;
+			}
+
+			BOOST_TEST((count>=5 && count<=11));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(blue_noise_aspect_and_cache)
+{
+	char cache_dir[]="/tmp/blue_noise_test_XXXXXX";
+
+	BOOST_TEST_REQUIRE(mkdtemp(cache_dir)!=nullptr);
+
+	// rows twice as tall as they are wide
+	auto generated=bayer::generate_blue_noise(8, 16, 2);
+	std::vector<int> sorted=generated.values;
+
+	std::sort(sorted.begin(), sorted.end());
+
+	for (int i=0; i<generated.size(); ++i)
+		BOOST_TEST(sorted[i]==i);
+
+	auto built=bayer::cached_blue_noise(8, 16, 2, cache_dir);
+	auto path=std::string(cache_dir)+"/blue_noise_8x16_2000.bin";
+
+	BOOST_TEST(built.values==generated.values);
+	BOOST_TEST_REQUIRE(std::ifstream(path).good());
+	BOOST_TEST(bayer::cached_blue_noise(8, 16, 2, cache_dir).values==generated.values);
+
+	// a truncated file is regenerated
+	truncate(path.c_str(), 20);
+	BOOST_TEST(bayer::cached_blue_noise(8, 16, 2, cache_dir).values==generated.values);
+
+	std::remove(path.c_str());
+	rmdir(cache_dir);
+}
+
+BOOST_DATA_TEST_CASE(error_diffusion_wavefront_matches_serial, bdata::make({ false, true })*bdata::make({ 0.f, .5f }), serpentine, temporal_weight)
+{
+	worker_options single;
+
+	single.num_threads=1;
+
+	parallel_process serial(single);
+	parallel_process wavefront(test_workers());
+	pooled_frame serial_out;
+	pooled_frame wavefront_out;
+
+	for (auto *pp : { &serial, &wavefront })
+	{
+		pp->render_passes.emplace_back(linearize());
+		pp->render_passes.emplace_back(error_diffusion<>::create(cga_palette(), normal_output(), nearest_lut_t(), serpentine, temporal_weight));
+	}
+
+	auto in=test_input_frame(70, 23);
+
+	for (int frame=0; frame<3; ++frame)
+	{
+		serial(in, serial_out);
+		wavefront(in, wavefront_out);
+
+		BOOST_TEST(same_pixels(serial_out, wavefront_out));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(error_diffusion_preserves_average)
+{
+	pooled_frame in;
+
+	in.resize(64, 32, 16);
+	in.aspect_ratio=4/3.f;
+
+	const std::uint16_t gray=(14 << 11) | (29 << 5) | 14; // between the grays of the palette
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; ++x)
+			*in.pixel<std::uint16_t>(x, y)=gray;
+	}
+
+	parallel_process pp(test_workers());
+	pooled_frame out;
+
+	pp.render_passes.emplace_back(linearize());
+	pp.render_passes.emplace_back(error_diffusion<>::create(cga_palette()));
+	pp(in, out);
+
+	auto expected=to_linear(srgb_from_image(in, 0, 0));
+	std::array<float, 3> sum={ { 0, 0, 0 } };
+	std::set<int> used;
+
+	for (int y=0; y<in.height; ++y)
+	{
+		for (int x=0; x<in.width; ++x)
+		{
+			int c=(*out.pixel<std::uint8_t>(x, y) >> ((x%2==1) ? 4 : 0)) & 0xf;
+
+			add_ref(sum, cga_palette()[c]);
+			used.insert(c);
+		}
+	}
+
+	BOOST_TEST(used.size()>1);
+
+	for (int i=0; i<3; ++i)
+		BOOST_TEST(std::abs(sum[i]/(in.width*in.height)-expected[i])<.01f);
+}
+
+BOOST_AUTO_TEST_CASE(error_diffusion_incremental_rerenders_rows_below)
+{
+	auto in=test_input_frame(48, 30);
+	parallel_process incremental(test_workers());
+	parallel_process full(test_workers());
+	pooled_frame incremental_out;
+	pooled_frame full_out;
+
+	incremental.incremental=true;
+
+	for (auto *pp : { &incremental, &full })
+	{
+		pp->render_passes.emplace_back(linearize());
+		pp->render_passes.emplace_back(error_diffusion<>::create(cga_palette()));
+	}
+
+	incremental(in, incremental_out);
+
+	for (int x=0; x<in.width; ++x)
+		*in.pixel<std::uint16_t>(x, 12)^=0x0841;
+
+	incremental(in, incremental_out);
+	full(in, full_out);
+
+	BOOST_TEST(same_pixels(incremental_out, full_out));
+}
+
+BOOST_AUTO_TEST_CASE(threshold_tile_matches_is_on)
+{
+	for (const auto &map : { bayer::generate(4, 4), bayer::generate(8, 8), bayer::generate(2, 3), bayer::generate(4, 8), bayer::generate_blue_noise(8, 8) })
+	{
+		const int width=37;
+		auto tile=map.thresholds(width, packed_dithered_color::mix_levels);
+		int mismatches=0;
+
+		for (int y=0; y<map.rows()*2; ++y)
+		{
+			for (int x=0; x<width; ++x)
+			{
+				for (int q=0; q<=packed_dithered_color::mix_levels; ++q)
+					mismatches+=map.is_on(x, y, q*(1.f/packed_dithered_color::mix_levels))!=(q>=tile.row(y)[x]);
+			}
+		}
+
+		BOOST_TEST(mismatches==0);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(dither_row_matches_scalar)
+{
+	const int count=53;
+	std::vector<packed_dithered_color> entries(count);
+	std::vector<std::uint8_t> thresholds(count);
+	std::vector<std::uint8_t> out(count);
+
+	for (int i=0; i<count; ++i)
+	{
+		entries[i].left_color=i%16;
+		entries[i].right_color=15-i%16;
+		entries[i].mix=(i*97)%256;
+		entries[i].reserved=0xff;
+		thresholds[i]=(i*61+7)%256;
+	}
+
+	dither_row(entries.data(), thresholds.data(), count, out.data());
+
+	for (int i=0; i<count; ++i)
+		BOOST_TEST(out[i]==((entries[i].mix>=thresholds[i]) ? entries[i].right_color : entries[i].left_color));
+}
+
+BOOST_DATA_TEST_CASE(write_row_matches_pp, bdata::make({ false, true }), staggered)
+{
+	auto in=test_input_frame(71, 3);
+	auto indices=std::get<1>(combine_palette(cga_palette()));
+
+	auto check=[&] (auto output_algorithm, int color_count)
+	{
+		auto row_algorithm=output_algorithm;
+		pooled_frame pixel_out;
+		pooled_frame row_out;
+		std::vector<std::uint8_t> colors(in.width);
+
+		output_algorithm.new_frame(in, pixel_out);
+		row_algorithm.new_frame(in, row_out);
+		pixel_out.clear();
+		row_out.clear();
+
+		for (int y=0; y<in.height; ++y)
+		{
+			for (int x=0; x<in.width; ++x)
+			{
+				colors[x]=(x*7+y*3)%color_count;
+				output_algorithm.pp(pixel_out, x, y, colors[x]);
+			}
+
+			// runs starting on both nibbles of a byte
+			row_algorithm.write_row(row_out, 0, y, colors.data(), 37);
+			row_algorithm.write_row(row_out, 37, y, colors.data()+37, in.width-37);
+		}
+
+		BOOST_TEST(same_pixels(pixel_out, row_out));
+	};
+
+	temporal_dither_output tdo;
+	async_temporal_dither_output atdo;
+
+	tdo.indices=atdo.indices=indices;
+	tdo.staggered=atdo.staggered=staggered;
+
+	check(normal_output(), 16);
+	check(tdo, indices.size());
+	check(atdo, indices.size());
+}
@@ -21,6 +21,7 @@ int main()
 #include "netvid/protocol.h"
 #include "netvid/net.h"
 
+#include "downsample/frame_pool.cpp"
 #include "downsample/parallel_process.cpp"
 
 #include "common/cga.h"
@@ -41,6 +42,8 @@ int main(int argc, char **argv)
 		boost::optional<int> flicker_select;
 		std::array<int, 2> offset = { 0, 0 };
 		std::array<int, 2> scale = { -1, -1 };
+		worker_options workers;
+		double stats_interval=0;
 
 		desc.add_options()
 			("help", "produce help message")
@@ -49,6 +52,11 @@ int main(int argc, char **argv)
 			("flicker-select", po::value<int>(), "Select flicker frame [0,1]")
 			("offset", po::value<std::string>(), "Offset frame in pixels <x,y>")
 			("scale", po::value<std::string>(), "Force pixel scaling <x,y>")
+			("threads", po::value<int>(&workers.num_threads), "Number of render threads (default: hardware concurrency)")
+			("cpus", po::value<std::string>(), "Pin render threads to CPUs (arg: e.g. 0,2-3)")
+			("rt-priority", po::value<int>(&workers.rt_priority), "Run render threads with SCHED_FIFO at this priority")
+			("mlock", po::bool_switch(&workers.lock_memory), "Lock all process memory in RAM")
+			("stats", po::value<double>(&stats_interval), "Print render timing statistics every <n> seconds")
 			;
 
 		po::variables_map vm;
@@ -62,6 +70,9 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
+		if (vm.count("cpus"))
+			workers.cpus=worker_options::parse_cpu_list(vm["cpus"].as<std::string>());
+
 		if (vm.count("flicker-select"))
 			flicker_select=vm["flicker-select"].as<int>();
 
@@ -143,8 +154,12 @@ int main(int argc, char **argv)
 			last_frame=std::chrono::steady_clock::now();
 		};
 
-		parallel_process pp;
+		parallel_process pp(workers);
 		int frame_idx=0;
+		auto last_stats_dump=std::chrono::steady_clock::now();
+
+		if (stats_interval>0)
+			pp.enable_stats();
 
 		pp.render_passes.emplace_back(
 				[=] (const frame_data &in, parallel_process::render_pass_t &render_pass)
@@ -190,10 +205,17 @@ int main(int argc, char **argv)
 				fb.wait_for_vsync();
 
 				const auto &buffer=fr.front_buffer;
-				static frame_data_managed dummy;
+				static pooled_frame dummy;
 
 				pp(buffer, dummy);
 				++frame_idx;
+
+				if (pp.stats && now-last_stats_dump>=std::chrono::duration<double>(stats_interval))
+				{
+					pp.stats->dump(std::cout, pp.render_passes.size(), pp.num_threads());
+					pp.stats->reset();
+					last_stats_dump=now;
+				}
 			}
 			else
 			{
@@ -22,6 +22,7 @@ int main()
 #include "netvid/check.h"
 #include "netvid/linux_framebuffer.h"
 
+#include "downsample/frame_pool.cpp"
 #include "downsample/parallel_process.cpp"
 
 #include "dpi.h"
@@ -164,7 +165,7 @@ int main(int argc, char **argv)
 		{
 			fb.wait_for_vsync();
 
-			static frame_data_managed dummy;
+			static pooled_frame dummy;
 
 			pp(test_image, dummy);
 